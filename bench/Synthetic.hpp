@@ -0,0 +1,51 @@
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#ifndef SYNTHETIC_HPP
+#define SYNTHETIC_HPP
+
+using namespace std;
+
+// A valid program of at least bytes characters, made of functions with
+// loops, conditionals, arithmetic, comments and calls to the function before
+// them, like the generated sources the benchmarks are about. It needs no
+// imports and prints nothing.
+static string SyntheticProgram(size_t bytes) {
+	string program;
+	char text[1024];
+	char call[64] = "x * 2";
+	for (unsigned k = 0; program.size() < bytes; ++k) {
+		// every function but the first calls the one before it
+		if (k > 0)
+			snprintf(call, sizeof(call), "f%u(i, x)", k - 1);
+		snprintf(text, sizeof(text),
+				"# helper %u, generated\n"
+				"func f%u(x y)\n"
+				"\tvar s = 0;\n"
+				"\tfor i = 0, i < y in\n"
+				"\t\tif i < x then\n"
+				"\t\t\ts = s + i * 1.5 - x / 3;\n"
+				"\t\telsif x < i then\n"
+				"\t\t\ts = s - %s;\n"
+				"\t\telse\n"
+				"\t\t\ts = s + 0.25;\n"
+				"\t\tend\n"
+				"\tend\n"
+				"\ts;\n"
+				"end\n\n",
+				k, k, call);
+		program += text;
+	}
+	return program;
+}
+
+// write SyntheticProgram(bytes) to path, its size or 0 if it cannot be written
+static size_t WriteSyntheticProgram(const string &path, size_t bytes) {
+	string program = SyntheticProgram(bytes);
+	ofstream out(path.c_str(), ios::binary);
+	out << program;
+	return out ? program.size() : 0;
+}
+
+#endif
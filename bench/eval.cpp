@@ -0,0 +1,130 @@
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <set>
+#include <string>
+
+#include "BuiltIns.hpp"
+#include "Driver.hpp"
+#include "Evaluator.hpp"
+
+using namespace std;
+
+// Time the evaluator spends on each top level expression of a program, and
+// whether it ran it or left it to the JIT. Definitions and imports are read
+// as the JIT reads them, handing the evaluator the AST of each definition.
+// Expressions left to the JIT are not compiled, their time is what the
+// evaluator wasted before giving up. The best of runs tries is reported,
+// expressions that are evaluated run once, since their output is written.
+//
+//   bin/bench-eval [runs [file]]
+
+static double Seconds() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+struct Bench {
+	CompilerSession &Session;
+	Codegen &Gen;
+	Evaluator &Eval;
+	unsigned Runs;
+	set<string> Read;
+
+	Bench(CompilerSession &session, Codegen &gen, Evaluator &eval, unsigned runs)
+			: Session(session), Gen(gen), Eval(eval), Runs(runs) {
+	}
+
+	void Expression(FunctionAST *expr, unsigned line) {
+		FunctionAST *exprs[1] = { expr };
+		double best = 0;
+		bool evaluated = false;
+		for (unsigned i = 0; i < Runs && !evaluated; ++i) {
+			double start = Seconds();
+			evaluated = Eval.Run(exprs);
+			double time = Seconds() - start;
+			if (i == 0 || time < best)
+				best = time;
+		}
+		pflush();
+		printf("\nline %4u  %-12s %10.1f us  %6u steps\n", line + 1, evaluated ? "evaluated" : "left to JIT",
+				best * 1e6, Eval.GetSteps());
+	}
+
+	void File(string file) {
+		if ( !Read.insert(file).second)
+			return;
+
+		// the parser reports through its lexer, the importer's is put back
+		Diagnostics &diag = Session.GetDiagnostics();
+		Lexer *importer = diag.GetLexer();
+		Parser parser(Session);
+		parser.SetInputFile(file, 0);
+		parser.GetNextToken();
+		while (parser.GetCurTok() != tok_eof) {
+			switch (parser.GetCurTok()) {
+				case tok_func:
+					if (FunctionAST *func = parser.ParseDefinition()) {
+						PrototypeAST *proto = func->GetPrototype();
+						if (Gen.Generate(func))
+							Eval.Define(proto->GetName(), proto->GetArgs(), func->GetBody());
+					} else
+						parser.GetNextToken();
+					break;
+				case tok_op:
+					if (OperatorAST *opr = parser.ParseOperator()) {
+						// codegen frees the AST, the evaluator copies it first
+						string name = string(opr->IsBinary() ? "binary" : "unary") + opr->GetOp();
+						Eval.Define(name, opr->GetArgs(), opr->GetBody());
+						Gen.Generate(opr, parser.TakeArena());
+					} else
+						parser.GetNextToken();
+					break;
+				case tok_extern:
+					if ( !Gen.Generate(parser.ParseExtern()))
+						parser.GetNextToken();
+					break;
+				case tok_import:
+					if (ImportAST *imp = parser.ParseImport())
+						this->File(imp->FileName.str() + ".wtf");
+					parser.GetNextToken();
+					break;
+				case tok_end:
+				case ';':
+					parser.GetNextToken();
+					break;
+				default: {
+					unsigned line = diag.GetLexer()->GetCursorLinePosition();
+					if (FunctionAST *expr = parser.ParseTopLevelExpr())
+						this->Expression(expr, line);
+					else
+						parser.GetNextToken();
+					break;
+				}
+			}
+			parser.ReleaseAST();
+		}
+		diag.SetLexer(importer);
+	}
+};
+
+int main(int argc, char **argv) {
+	unsigned runs = argc > 1 ? atoi(argv[1]) : 20;
+	string file = argc > 2 ? argv[2] : "bench/eval.wtf";
+	if (runs == 0) {
+		fprintf(stderr, "usage: %s [runs [file]]\n", argv[0]);
+		return 1;
+	}
+
+	InitializeNativeTarget();
+	CompilerSession session;
+	Module *module = new Module("bench", session.GetContext());
+	DataLayout layout("");
+	Codegen *gen = new Codegen(session, &layout, module, 0);
+	Evaluator eval(module);
+
+	Bench bench(session, *gen, eval, runs);
+	bench.File(file);
+	return session.GetDiagnostics().GetCount() > 0;
+}
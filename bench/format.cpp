@@ -0,0 +1,89 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <stdint.h>
+#include <vector>
+#include "DoubleFormat.hpp"
+
+using namespace std;
+
+// Number output speed of FormatDouble against the printf loop it replaced,
+// trying 15, 16 and 17 significant digits until the text reads back.
+//
+//   bin/bench-format [millions of numbers]
+
+static int FormatPrintf(double num, char *out) {
+	int length = 0;
+	for (int precision = 15; precision <= 17; ++precision) {
+		length = snprintf(out, 32, "%.*g", precision, num);
+		if (strtod(out, 0) == num)
+			break;
+	}
+	return length;
+}
+
+static double Seconds() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// characters written for values and the time it took
+static size_t Measure(int (*format)(double, char*), const vector<double> &values, double &time) {
+	char text[32];
+	size_t characters = 0;
+	double start = Seconds();
+	for (size_t i = 0; i < values.size(); ++i)
+		characters += format(values[i], text);
+	time = Seconds() - start;
+	return characters;
+}
+
+int main(int argc, char **argv) {
+	double millions = argc > 1 ? atof(argv[1]) : 2;
+	if (millions <= 0) {
+		fprintf(stderr, "usage: %s [millions of numbers]\n", argv[0]);
+		return 1;
+	}
+
+	// results of arithmetic, like 0.1 * 3, and random doubles of any
+	// magnitude, neither of which take the whole number shortcut
+	vector<double> values;
+	uint64_t state = 88172645463325252u;
+	for (size_t i = 0; i < (size_t) (millions * 1e6); ++i) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		double num;
+		if (i % 2 == 0)
+			num = (double) (state % 1000000) / 1000 * 0.1;
+		else {
+			uint64_t bits = (state & ~(UINT64_C(0x7ff) << 52)) | ((1 + state % 2045) << 52);
+			memcpy( &num, &bits, sizeof(num));
+		}
+		values.push_back(num);
+	}
+
+	double printfTime, shortestTime;
+	size_t printfChars = Measure(FormatPrintf, values, printfTime);
+	size_t shortestChars = Measure(FormatDouble, values, shortestTime);
+
+	printf("%zu numbers\n", values.size());
+	printf("printf    %8.3f s  %6.1f ns/number  %5.2f characters/number\n", printfTime,
+			printfTime * 1e9 / values.size(), (double) printfChars / values.size());
+	printf("shortest  %8.3f s  %6.1f ns/number  %5.2f characters/number\n", shortestTime,
+			shortestTime * 1e9 / values.size(), (double) shortestChars / values.size());
+	printf("speedup   %.2fx\n", printfTime / shortestTime);
+
+	// both must read back
+	char text[32];
+	for (size_t i = 0; i < values.size(); ++i) {
+		text[FormatDouble(values[i], text)] = 0;
+		if (strtod(text, 0) != values[i]) {
+			fprintf(stderr, "%s does not read back\n", text);
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Startup time of bin/wtf with and without -lazy: the mean wall time of runs
+# runs of each example, output discarded. Run from the top of the tree after
+# make.
+#
+#   bench/lazy.sh [runs [files...]]
+#
+# No results are recorded for it yet: it was written where bin/wtf, which
+# needs LLVM 3.2, could not be built, and only run against a stand-in.
+
+runs=${1:-20}
+[ $# -gt 0 ] && shift
+files=${*:-examples/mandel.wtf examples/test.wtf}
+
+# mean seconds of $runs runs of the command given
+mean() {
+	start=$(date +%s.%N)
+	i=0
+	while [ $i -lt $runs ]; do
+		"$@" > /dev/null 2>&1
+		i=$((i + 1))
+	done
+	end=$(date +%s.%N)
+	echo "$start $end $runs" | awk '{ printf "%.4f", ($2 - $1) / $3 }'
+}
+
+if [ ! -x bin/wtf ]; then
+	echo "bin/wtf not found, run make first" >&2
+	exit 1
+fi
+
+for file in $files; do
+	eager=$(mean bin/wtf "$file")
+	lazy=$(mean bin/wtf -lazy "$file")
+	speedup=$(echo "$eager $lazy" | awk '{ printf "%.2f", $1 / $2 }')
+	echo "$file: eager ${eager}s, -lazy ${lazy}s (${speedup}x), mean of $runs runs"
+done
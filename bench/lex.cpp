@@ -0,0 +1,192 @@
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <string>
+#include "Lexer.hpp"
+#include "Synthetic.hpp"
+
+using namespace std;
+
+// Lexing throughput of the buffer based Lexer against the ifstream lexer it
+// replaced, on a generated program.
+//
+//   bin/bench-lex [megabytes [runs]]
+
+// the lexer before it read whole buffers, a character at a time through an
+// ifstream with identifiers, numbers and strings built up in std::string
+class StreamLexer {
+	int LastChar;
+	ifstream InputFileStream;
+	string IdentifierStr;
+	string StringVal;
+	double NumVal;
+
+	int CursorPosition;
+	int CursorColumnPosition;
+	int CursorLinePosition;
+
+public:
+	StreamLexer(string file)
+			: LastChar(' '), InputFileStream(file.c_str()), NumVal(0), CursorPosition(0),
+			CursorColumnPosition(0), CursorLinePosition(0) {
+	}
+
+	int GetNextChar() {
+		CursorPosition++;
+		CursorColumnPosition++;
+
+		char ch = InputFileStream.get();
+		if (ch == '\n') {
+			CursorLinePosition++;
+			CursorColumnPosition = 0;
+		}
+		return ch;
+	}
+
+	int GetToken() {
+		while (isspace(LastChar))
+			LastChar = this->GetNextChar();
+
+		if (isalpha(LastChar)) {
+			IdentifierStr = LastChar;
+			while (isalnum(LastChar = this->GetNextChar()))
+				IdentifierStr += LastChar;
+
+			if (IdentifierStr == "func") return tok_func;
+			if (IdentifierStr == "extern") return tok_extern;
+			if (IdentifierStr == "if") return tok_if;
+			if (IdentifierStr == "then") return tok_then;
+			if (IdentifierStr == "else") return tok_else;
+			if (IdentifierStr == "elsif") return tok_elsif;
+			if (IdentifierStr == "for") return tok_for;
+			if (IdentifierStr == "in") return tok_in;
+			if (IdentifierStr == "op") return tok_op;
+			if (IdentifierStr == "import") return tok_import;
+			if (IdentifierStr == "end") return tok_end;
+			if (IdentifierStr == "var") return tok_var;
+
+			return tok_identifier;
+		}
+
+		if (isdigit(LastChar) || LastChar == '.') {
+			string NumStr;
+			do {
+				NumStr += LastChar;
+				LastChar = this->GetNextChar();
+			}
+			while (isdigit(LastChar) || LastChar == '.');
+
+			NumVal = strtod(NumStr.c_str(), 0);
+			return tok_number;
+		}
+
+		if (LastChar == '#') {
+			do
+				LastChar = this->GetNextChar();
+			while (LastChar != '\n' && LastChar != EOF);
+
+			if (LastChar != EOF)
+				return GetToken();
+		}
+
+		if (LastChar == '\'') {
+			StringVal.clear();
+			LastChar = this->GetNextChar();
+			while (LastChar != '\'' && LastChar != EOF) {
+				StringVal += LastChar;
+				LastChar = this->GetNextChar();
+			}
+			LastChar = this->GetNextChar();
+			return tok_string;
+		}
+
+		if (LastChar == EOF)
+			return tok_eof;
+
+		int ThisChar = LastChar;
+		LastChar = this->GetNextChar();
+		return ThisChar;
+	}
+};
+
+static double Seconds() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// tokens lex reads and its best time over runs
+template<class Lex>
+static size_t Measure(Lex lex, int runs, double &best) {
+	size_t tokens = 0;
+	best = 0;
+	for (int run = 0; run < runs; ++run) {
+		double start = Seconds();
+		tokens = lex();
+		double time = Seconds() - start;
+		if (run == 0 || time < best)
+			best = time;
+	}
+	return tokens;
+}
+
+struct LexStream {
+	string File;
+	size_t operator()() const {
+		StreamLexer lexer(File);
+		size_t tokens = 0;
+		while (lexer.GetToken() != tok_eof)
+			++tokens;
+		return tokens;
+	}
+};
+
+struct LexBuffer {
+	string File;
+	size_t operator()() const {
+		Diagnostics diag;
+		Lexer lexer(diag);
+		lexer.SetInputFile(File, 0);
+		size_t tokens = 0;
+		while (lexer.GetToken() != tok_eof)
+			++tokens;
+		return tokens;
+	}
+};
+
+int main(int argc, char **argv) {
+	double megabytes = argc > 1 ? atof(argv[1]) : 16;
+	int runs = argc > 2 ? atoi(argv[2]) : 5;
+	if (megabytes <= 0 || runs <= 0) {
+		fprintf(stderr, "usage: %s [megabytes [runs]]\n", argv[0]);
+		return 1;
+	}
+
+	string file = "bench-lex.wtf";
+	size_t bytes = WriteSyntheticProgram(file, (size_t) (megabytes * 1024 * 1024));
+	if ( !bytes) {
+		fprintf(stderr, "cannot write %s\n", file.c_str());
+		return 1;
+	}
+
+	LexStream stream = { file };
+	LexBuffer buffer = { file };
+	double streamTime, bufferTime;
+	size_t streamTokens = Measure(stream, runs, streamTime);
+	size_t bufferTokens = Measure(buffer, runs, bufferTime);
+	remove(file.c_str());
+
+	double size = bytes / (1024.0 * 1024.0);
+	printf("%.1f MB, best of %d runs\n", size, runs);
+	printf("ifstream  %9zu tokens  %8.3f s  %8.1f MB/s\n", streamTokens, streamTime, size / streamTime);
+	printf("buffer    %9zu tokens  %8.3f s  %8.1f MB/s\n", bufferTokens, bufferTime, size / bufferTime);
+	printf("speedup   %.2fx\n", streamTime / bufferTime);
+
+	if (streamTokens != bufferTokens) {
+		fprintf(stderr, "token counts differ\n");
+		return 1;
+	}
+	return 0;
+}
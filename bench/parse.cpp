@@ -0,0 +1,102 @@
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <sys/resource.h>
+
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetRegistry.h"
+
+#include "Driver.hpp"
+#include "Synthetic.hpp"
+
+using namespace std;
+
+// Parse and codegen time and peak memory on a generated program. The
+// program is parsed on its own first, then parsed and compiled to an
+// optimized module as wtf -c would, without writing the object file.
+//
+//   bin/bench-parse [megabytes [optLevel]]
+
+static double Seconds() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// peak resident set of the process so far, in MB
+static double PeakRSS() {
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024.0;
+}
+
+// parse every definition of file, dropping the AST of each, returns how
+// many there were
+static unsigned ParseOnly(CompilerSession &session, string file) {
+	Parser parser(session);
+	parser.SetInputFile(file, 0);
+	parser.GetNextToken();
+
+	unsigned definitions = 0;
+	while (parser.GetCurTok() != tok_eof) {
+		if (parser.GetCurTok() == tok_func && parser.ParseDefinition())
+			++definitions;
+		else
+			parser.GetNextToken();
+		parser.ReleaseAST();
+	}
+	return definitions;
+}
+
+int main(int argc, char **argv) {
+	double megabytes = argc > 1 ? atof(argv[1]) : 8;
+	unsigned optLevel = argc > 2 ? atoi(argv[2]) : 1;
+	if (megabytes <= 0 || optLevel > 3) {
+		fprintf(stderr, "usage: %s [megabytes [optLevel]]\n", argv[0]);
+		return 1;
+	}
+
+	string file = "bench-parse.wtf";
+	size_t bytes = WriteSyntheticProgram(file, (size_t) (megabytes * 1024 * 1024));
+	if ( !bytes) {
+		fprintf(stderr, "cannot write %s\n", file.c_str());
+		return 1;
+	}
+	double size = bytes / (1024.0 * 1024.0);
+	printf("%.1f MB, -O%u, peak RSS %.1f MB at start\n", size, optLevel, PeakRSS());
+
+	InitializeNativeTarget();
+	CompilerSession session;
+
+	double start = Seconds();
+	unsigned definitions = ParseOnly(session, file);
+	double parseTime = Seconds() - start;
+	printf("parse          %8.3f s  %8.1f MB/s  %u functions  peak RSS %.1f MB\n",
+			parseTime, size / parseTime, definitions, PeakRSS());
+
+	string error;
+	string triple = sys::getDefaultTargetTriple();
+	const Target *target = TargetRegistry::lookupTarget(triple, error);
+	if ( !target) {
+		fprintf(stderr, "Could not find target: %s\n", error.c_str());
+		return 1;
+	}
+	TargetMachine *machine = target->createTargetMachine(triple, sys::getHostCPUName(), "",
+			TargetOptions(), Reloc::PIC_, CodeModel::Default, Codegen::CodeGenLevel(optLevel));
+
+	Module *module = new Module("bench", session.GetContext());
+	module->setTargetTriple(triple);
+	module->setDataLayout(machine->getDataLayout()->getStringRepresentation());
+	Codegen *gen = new Codegen(session, machine->getDataLayout(), module, optLevel);
+	Driver driver(session, gen);
+
+	start = Seconds();
+	driver.Go(file);
+	double compileTime = Seconds() - start;
+	printf("parse+codegen  %8.3f s  %8.1f MB/s  %u in module  peak RSS %.1f MB\n",
+			compileTime, size / compileTime, (unsigned) module->size(), PeakRSS());
+
+	remove(file.c_str());
+	return session.GetDiagnostics().GetCount() > 0;
+}
@@ -1,6 +1,9 @@
 #include "llvm/DerivedTypes.h"
 #include "llvm/LLVMContext.h"
 #include "llvm/Module.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Casting.h"
 
 #include <cstdio>
 #include <cstdlib>
@@ -8,6 +11,8 @@
 #include <vector>
 #include <map>
 
+#include "ASTArena.hpp"
+
 #ifndef AST_HPP
 #define AST_HPP
 
@@ -20,42 +25,64 @@ enum ASTType {
 	ASTPrototype, ASTFunction,
 	ASTOperator, ASTUnary,
 	ASTBlock, ASTVar,
+	ASTArrayExpr, ASTIndexExpr,
+};
+
+// kind of each function parameter, arrays are passed as pointer and length
+enum ArgKind {
+	ScalarArg, ArrayArg,
 };
 
+// Nodes live in the ASTArena of the item they belong to. Strings and child
+// lists are views into the same arena, so nodes own no memory of their own,
+// are never destroyed individually and accessors never copy.
+//
+// Children are pointers rather than 32 bit indices into typed arrays. The
+// nodes of an item are already contiguous in its arena, in the order they
+// were parsed, and the arena is reset once the item is compiled, so AST
+// memory is bounded by the largest item, not the program. Indices would
+// shrink a binary node from 24 to 16 bytes, but every access would then
+// need the arrays at hand, and Codegen, the Evaluator and inline operators
+// would have to carry them along with each node.
+
 struct ImportAST {
-	string FileName;
+	StringRef FileName;
 	int ParentCursorPosition;
 
 public:
-	ImportAST(string fileName, int pcp)
+	ImportAST(StringRef fileName, int pcp)
 			: FileName(fileName), ParentCursorPosition(pcp) {
 	}
 };
 
 class ExprAST {
+	const ASTType Kind;
+
+protected:
+	ExprAST(ASTType kind)
+			: Kind(kind) {
+	}
+
 public:
-	virtual ~ExprAST() {
+	ASTType GetASTType() const {
+		return this->Kind;
 	}
-	virtual ASTType GetASTType() = 0;
 };
 
 // list of expressions form a block
 class BlockAST {
-	vector<ExprAST*> Expressions;
+	ArrayRef<ExprAST*> Expressions;
 
 public:
-	// TODO kill this constructor
-	BlockAST(int test) {
+	BlockAST(ArrayRef<ExprAST*> exprs)
+			: Expressions(exprs) {
 	}
-	BlockAST(ExprAST *expr);
-
-	void AppendExpression(ExprAST *expr);
 
-	vector<ExprAST*> GetExpressions() {
+	ArrayRef<ExprAST*> GetExpressions() const {
 		return this->Expressions;
 	}
 
-	ASTType GetASTType() {
+	ASTType GetASTType() const {
 		return ASTBlock;
 	}
 };
@@ -65,30 +92,30 @@ class NumberExprAST : public ExprAST {
 	double Val;
 	public:
 	NumberExprAST(double val)
-			: Val(val) {
+			: ExprAST(ASTNumberExpr), Val(val) {
 	}
-	double GetVal() {
+	double GetVal() const {
 		return this->Val;
 	}
 
-	virtual ASTType GetASTType() {
-		return ASTNumberExpr;
+	static bool classof(const ExprAST *expr) {
+		return expr->GetASTType() == ASTNumberExpr;
 	}
 };
 
 // Variable
 class VariableExprAST : public ExprAST {
-	string Name;
+	StringRef Name;
 	public:
-	VariableExprAST(const string &name)
-			: Name(name) {
+	VariableExprAST(StringRef name)
+			: ExprAST(ASTVariableExpr), Name(name) {
 	}
-	string GetName() {
+	StringRef GetName() const {
 		return this->Name;
 	}
 
-	virtual ASTType GetASTType() {
-		return ASTVariableExpr;
+	static bool classof(const ExprAST *expr) {
+		return expr->GetASTType() == ASTVariableExpr;
 	}
 };
 
@@ -98,20 +125,56 @@ class BinaryExprAST : public ExprAST {
 	ExprAST *LHS, *RHS;
 	public:
 	BinaryExprAST(char op, ExprAST *lhs, ExprAST *rhs)
-			: Op(op), LHS(lhs), RHS(rhs) {
+			: ExprAST(ASTBinaryExpr), Op(op), LHS(lhs), RHS(rhs) {
 	}
-	char GetOp() {
+	char GetOp() const {
 		return this->Op;
 	}
-	ExprAST *GetLHS() {
+	ExprAST *GetLHS() const {
 		return this->LHS;
 	}
-	ExprAST *GetRHS() {
+	ExprAST *GetRHS() const {
 		return this->RHS;
 	}
 
-	virtual ASTType GetASTType() {
-		return ASTBinaryExpr;
+	static bool classof(const ExprAST *expr) {
+		return expr->GetASTType() == ASTBinaryExpr;
+	}
+};
+
+// Allocation of a zeroed array, '[size]'
+class ArrayExprAST : public ExprAST {
+	ExprAST *Size;
+	public:
+	ArrayExprAST(ExprAST *size)
+			: ExprAST(ASTArrayExpr), Size(size) {
+	}
+	ExprAST *GetSize() const {
+		return this->Size;
+	}
+
+	static bool classof(const ExprAST *expr) {
+		return expr->GetASTType() == ASTArrayExpr;
+	}
+};
+
+// Array element, 'name[index]'
+class IndexExprAST : public ExprAST {
+	StringRef Name;
+	ExprAST *Index;
+	public:
+	IndexExprAST(StringRef name, ExprAST *index)
+			: ExprAST(ASTIndexExpr), Name(name), Index(index) {
+	}
+	StringRef GetName() const {
+		return this->Name;
+	}
+	ExprAST *GetIndex() const {
+		return this->Index;
+	}
+
+	static bool classof(const ExprAST *expr) {
+		return expr->GetASTType() == ASTIndexExpr;
 	}
 };
 
@@ -124,104 +187,126 @@ class ConditionalElement
 			: Cond(cond), Consequence(cons) {
 	}
 
-	ExprAST *GetCond() {
+	ExprAST *GetCond() const {
 		return this->Cond;
 	}
-	BlockAST *GetConsequence() {
+	BlockAST *GetConsequence() const {
 		return this->Consequence;
 	}
 };
 
 class ConditionalExprAST : public ExprAST {
-	vector<ConditionalElement*> Conds;
+	ArrayRef<ConditionalElement> Conds;
 	BlockAST *Else;
 
 public:
-	ConditionalExprAST(vector<ConditionalElement*> conds, BlockAST *els)
-			: Conds(conds), Else(els) {
+	ConditionalExprAST(ArrayRef<ConditionalElement> conds, BlockAST *els)
+			: ExprAST(ASTConditionalExpr), Conds(conds), Else(els) {
 	}
 
-	vector<ConditionalElement*> GetConds() {
+	ArrayRef<ConditionalElement> GetConds() const {
 		return this->Conds;
 	}
-	BlockAST *GetElse() {
+	BlockAST *GetElse() const {
 		return this->Else;
 	}
 
-	virtual ASTType GetASTType() {
-		return ASTConditionalExpr;
+	static bool classof(const ExprAST *expr) {
+		return expr->GetASTType() == ASTConditionalExpr;
 	}
 };
 
+// how a pfor combines the values of its iterations, the runtime's wtf_pfor
+// uses the same numbering
+enum Reduction {
+	NoReduction, SumReduction, MinReduction, MaxReduction
+};
+
 class ForExprAST : public ExprAST {
-	string IterName;
+	StringRef IterName;
 	ExprAST *Init, *Step, *End;
 	BlockAST *Body;
+	bool Parallel;
+	Reduction Reduce;
 	public:
-	ForExprAST(string iterName, ExprAST *init, ExprAST *step, ExprAST *end, BlockAST *body)
-			: IterName(iterName), Init(init), Step(step), End(end), Body(body) {
+	ForExprAST(StringRef iterName, ExprAST *init, ExprAST *step, ExprAST *end, BlockAST *body,
+			bool parallel = false, Reduction reduce = NoReduction)
+			: ExprAST(ASTForExpr), IterName(iterName), Init(init), Step(step), End(end), Body(body),
+			  Parallel(parallel), Reduce(reduce) {
 	}
 
-	string GetIterName() {
+	StringRef GetIterName() const {
 		return this->IterName;
 	}
-	ExprAST *GetInit() {
+	ExprAST *GetInit() const {
 		return this->Init;
 	}
-	ExprAST *GetStep() {
+	ExprAST *GetStep() const {
 		return this->Step;
 	}
-	ExprAST *GetEnd() {
+	ExprAST *GetEnd() const {
 		return this->End;
 	}
-	BlockAST *GetBody() {
+	BlockAST *GetBody() const {
 		return this->Body;
 	}
+	bool IsParallel() const {
+		return this->Parallel;
+	}
+	Reduction GetReduction() const {
+		return this->Reduce;
+	}
 
-	virtual ASTType GetASTType() {
-		return ASTForExpr;
+	static bool classof(const ExprAST *expr) {
+		return expr->GetASTType() == ASTForExpr;
 	}
 };
 
 // Function call
 class CallExprAST : public ExprAST {
-	string Callee;
-	vector<ExprAST*> Args;
+	StringRef Callee;
+	ArrayRef<ExprAST*> Args;
 	public:
-	CallExprAST(const string &callee, vector<ExprAST*> &args)
-			: Callee(callee), Args(args) {
+	CallExprAST(StringRef callee, ArrayRef<ExprAST*> args)
+			: ExprAST(ASTCallExpr), Callee(callee), Args(args) {
 	}
 
-	string GetCallee() {
+	StringRef GetCallee() const {
 		return this->Callee;
 	}
-	vector<ExprAST*> GetArgs() {
+	ArrayRef<ExprAST*> GetArgs() const {
 		return this->Args;
 	}
 
-	virtual ASTType GetASTType() {
-		return ASTCallExpr;
+	static bool classof(const ExprAST *expr) {
+		return expr->GetASTType() == ASTCallExpr;
 	}
 };
 
 // Function signature definition
 class PrototypeAST {
-	string Name;
-	vector<string> Args;
+	StringRef Name;
+	ArrayRef<StringRef> Args;
+	// empty if all arguments are scalars
+	ArrayRef<ArgKind> Kinds;
 	public:
-	PrototypeAST(const string &name, vector<string> &args)
-			: Name(name), Args(args) {
+	PrototypeAST(StringRef name, ArrayRef<StringRef> args, ArrayRef<ArgKind> kinds = ArrayRef<ArgKind>())
+			: Name(name), Args(args), Kinds(kinds) {
 	}
 
-	string GetName() {
+	StringRef GetName() const {
 		return this->Name;
 	}
 
-	vector<string> GetArgs() {
+	ArrayRef<StringRef> GetArgs() const {
 		return this->Args;
 	}
 
-	ASTType GetASTType() {
+	bool IsArrayArg(unsigned i) const {
+		return i < this->Kinds.size() && this->Kinds[i] == ArrayArg;
+	}
+
+	ASTType GetASTType() const {
 		return ASTPrototype;
 	}
 };
@@ -235,15 +320,15 @@ class FunctionAST {
 			: Prototype(prototype), Body(body) {
 	}
 
-	PrototypeAST *GetPrototype() {
+	PrototypeAST *GetPrototype() const {
 		return this->Prototype;
 	}
 
-	BlockAST *GetBody() {
+	BlockAST *GetBody() const {
 		return this->Body;
 	}
 
-	ASTType GetASTType() {
+	ASTType GetASTType() const {
 		return ASTFunction;
 	}
 };
@@ -253,18 +338,18 @@ class UnaryExprAST : public ExprAST {
 	ExprAST *Operand;
 	public:
 	UnaryExprAST(char op, ExprAST *operand)
-			: Op(op), Operand(operand) {
+			: ExprAST(ASTUnary), Op(op), Operand(operand) {
 	}
 
-	char GetOp() {
+	char GetOp() const {
 		return this->Op;
 	}
-	ExprAST *GetOperand() {
+	ExprAST *GetOperand() const {
 		return this->Operand;
 	}
 
-	ASTType GetASTType() {
-		return ASTUnary;
+	static bool classof(const ExprAST *expr) {
+		return expr->GetASTType() == ASTUnary;
 	}
 };
 
@@ -272,57 +357,230 @@ class UnaryExprAST : public ExprAST {
 class OperatorAST {
 	char Op;
 	int Precedence;
-	vector<string> Args;
+	ArrayRef<StringRef> Args;
 	BlockAST *Body;
 	public:
-	OperatorAST(char op, int prec, vector<string> args, BlockAST *body)
+	OperatorAST(char op, int prec, ArrayRef<StringRef> args, BlockAST *body)
 			: Op(op), Precedence(prec), Args(args), Body(body) {
 	}
 
-	char GetOp() {
+	char GetOp() const {
 		return this->Op;
 	}
 
-	int GetPrecedence() {
+	int GetPrecedence() const {
 		return this->Precedence;
 	}
 
-	vector<string> GetArgs() {
+	ArrayRef<StringRef> GetArgs() const {
 		return this->Args;
 	}
 
-	BlockAST *GetBody() {
+	BlockAST *GetBody() const {
 		return this->Body;
 	}
 
-	bool IsBinary() {
+	bool IsBinary() const {
 		return this->Args.size() == 2;
 	}
 
-	ASTType GetASTType() {
+	ASTType GetASTType() const {
 		return ASTOperator;
 	}
 };
 
 class VarExprAST : public ExprAST {
-	string Name;
+	StringRef Name;
 	ExprAST *InitialValue;
 	public:
-	VarExprAST(string name, ExprAST *initVal)
-			: Name(name), InitialValue(initVal) {
+	VarExprAST(StringRef name, ExprAST *initVal)
+			: ExprAST(ASTVar), Name(name), InitialValue(initVal) {
 	}
 
-	string GetName() {
+	StringRef GetName() const {
 		return this->Name;
 	}
 
-	ExprAST *GetInitialValue() {
+	ExprAST *GetInitialValue() const {
 		return this->InitialValue;
 	}
 
-	ASTType GetASTType() {
-		return ASTVar;
+	static bool classof(const ExprAST *expr) {
+		return expr->GetASTType() == ASTVar;
+	}
+};
+
+// Calls Derived's Visit overload for the kind of an expression with the node
+// as a const reference, so passes over the AST neither copy nor cast
+// themselves. Derived has a Visit for every expression class, all returning
+// Result.
+template <typename Derived, typename Result>
+class ExprVisitor {
+public:
+	Result Dispatch(const ExprAST &expr) {
+		Derived &self = static_cast<Derived&>( *this);
+		switch (expr.GetASTType()) {
+			case ASTNumberExpr:
+				return self.Visit(cast<NumberExprAST>(expr));
+			case ASTVariableExpr:
+				return self.Visit(cast<VariableExprAST>(expr));
+			case ASTBinaryExpr:
+				return self.Visit(cast<BinaryExprAST>(expr));
+			case ASTCallExpr:
+				return self.Visit(cast<CallExprAST>(expr));
+			case ASTConditionalExpr:
+				return self.Visit(cast<ConditionalExprAST>(expr));
+			case ASTForExpr:
+				return self.Visit(cast<ForExprAST>(expr));
+			case ASTUnary:
+				return self.Visit(cast<UnaryExprAST>(expr));
+			case ASTVar:
+				return self.Visit(cast<VarExprAST>(expr));
+			case ASTArrayExpr:
+				return self.Visit(cast<ArrayExprAST>(expr));
+			case ASTIndexExpr:
+				return self.Visit(cast<IndexExprAST>(expr));
+			default:
+				// prototypes, functions, operators and blocks are not expressions
+				return Result();
+		}
 	}
 };
 
+// copies expressions into another arena, so they outlive the item they
+// were read in
+class CopyExpr : public ExprVisitor<CopyExpr, ExprAST*> {
+	ASTArena &Arena;
+
+public:
+	CopyExpr(ASTArena &arena)
+			: Arena(arena) {
+	}
+
+	ExprAST *Copy(const ExprAST *expr) {
+		return expr ? this->Dispatch( *expr) : 0;
+	}
+
+	ArrayRef<StringRef> Copy(ArrayRef<StringRef> names) {
+		vector<StringRef> copies;
+		for (unsigned i = 0; i < names.size(); ++i)
+			copies.push_back(Arena.CopyString(names[i]));
+		return Arena.CopyArray(copies);
+	}
+
+	BlockAST *Copy(const BlockAST *block) {
+		if ( !block)
+			return 0;
+
+		ArrayRef<ExprAST*> exprs = block->GetExpressions();
+		vector<ExprAST*> copies;
+		for (unsigned i = 0; i < exprs.size(); ++i)
+			copies.push_back(this->Copy(exprs[i]));
+		return Arena.Create<BlockAST>(Arena.CopyArray(copies));
+	}
+
+	ExprAST *Visit(const NumberExprAST &expr) {
+		return Arena.Create<NumberExprAST>(expr.GetVal());
+	}
+	ExprAST *Visit(const VariableExprAST &expr) {
+		return Arena.Create<VariableExprAST>(Arena.CopyString(expr.GetName()));
+	}
+	ExprAST *Visit(const BinaryExprAST &expr) {
+		return Arena.Create<BinaryExprAST>(expr.GetOp(), this->Copy(expr.GetLHS()), this->Copy(expr.GetRHS()));
+	}
+	ExprAST *Visit(const UnaryExprAST &expr) {
+		return Arena.Create<UnaryExprAST>(expr.GetOp(), this->Copy(expr.GetOperand()));
+	}
+	ExprAST *Visit(const CallExprAST &expr) {
+		ArrayRef<ExprAST*> args = expr.GetArgs();
+		vector<ExprAST*> copies;
+		for (unsigned i = 0; i < args.size(); ++i)
+			copies.push_back(this->Copy(args[i]));
+		return Arena.Create<CallExprAST>(Arena.CopyString(expr.GetCallee()), Arena.CopyArray(copies));
+	}
+	ExprAST *Visit(const ConditionalExprAST &expr) {
+		ArrayRef<ConditionalElement> conds = expr.GetConds();
+		vector<ConditionalElement> copies;
+		for (unsigned i = 0; i < conds.size(); ++i)
+			copies.push_back(ConditionalElement(this->Copy(conds[i].GetCond()),
+					this->Copy(conds[i].GetConsequence())));
+		return Arena.Create<ConditionalExprAST>(Arena.CopyArray(copies), this->Copy(expr.GetElse()));
+	}
+	ExprAST *Visit(const ForExprAST &expr) {
+		return Arena.Create<ForExprAST>(Arena.CopyString(expr.GetIterName()), this->Copy(expr.GetInit()),
+				this->Copy(expr.GetStep()), this->Copy(expr.GetEnd()), this->Copy(expr.GetBody()),
+				expr.IsParallel(), expr.GetReduction());
+	}
+	ExprAST *Visit(const VarExprAST &expr) {
+		return Arena.Create<VarExprAST>(Arena.CopyString(expr.GetName()), this->Copy(expr.GetInitialValue()));
+	}
+	ExprAST *Visit(const ArrayExprAST &expr) {
+		return Arena.Create<ArrayExprAST>(this->Copy(expr.GetSize()));
+	}
+	ExprAST *Visit(const IndexExprAST &expr) {
+		return Arena.Create<IndexExprAST>(Arena.CopyString(expr.GetName()), this->Copy(expr.GetIndex()));
+	}
+};
+
+template <typename Predicate>
+bool AnyExpr(const ExprAST *expr, const Predicate &pred);
+
+template <typename Predicate>
+bool AnyExpr(const BlockAST *block, const Predicate &pred) {
+	if ( !block)
+		return false;
+
+	ArrayRef<ExprAST*> exprs = block->GetExpressions();
+	for (unsigned i = 0; i < exprs.size(); ++i)
+		if (AnyExpr(exprs[i], pred))
+			return true;
+	return false;
+}
+
+// whether pred holds for expr or any expression nested in it
+template <typename Predicate>
+bool AnyExpr(const ExprAST *expr, const Predicate &pred) {
+	if ( !expr)
+		return false;
+	if (pred(expr))
+		return true;
+
+	switch (expr->GetASTType()) {
+		case ASTBinaryExpr: {
+			const BinaryExprAST *binary = cast<BinaryExprAST>(expr);
+			return AnyExpr(binary->GetLHS(), pred) || AnyExpr(binary->GetRHS(), pred);
+		}
+		case ASTUnary:
+			return AnyExpr(cast<UnaryExprAST>(expr)->GetOperand(), pred);
+		case ASTCallExpr: {
+			ArrayRef<ExprAST*> args = cast<CallExprAST>(expr)->GetArgs();
+			for (unsigned i = 0; i < args.size(); ++i)
+				if (AnyExpr(args[i], pred))
+					return true;
+			return false;
+		}
+		case ASTConditionalExpr: {
+			const ConditionalExprAST *cond = cast<ConditionalExprAST>(expr);
+			ArrayRef<ConditionalElement> conds = cond->GetConds();
+			for (unsigned i = 0; i < conds.size(); ++i)
+				if (AnyExpr(conds[i].GetCond(), pred) || AnyExpr(conds[i].GetConsequence(), pred))
+					return true;
+			return AnyExpr(cond->GetElse(), pred);
+		}
+		case ASTForExpr: {
+			const ForExprAST *loop = cast<ForExprAST>(expr);
+			return AnyExpr(loop->GetInit(), pred) || AnyExpr(loop->GetStep(), pred)
+					|| AnyExpr(loop->GetEnd(), pred) || AnyExpr(loop->GetBody(), pred);
+		}
+		case ASTVar:
+			return AnyExpr(cast<VarExprAST>(expr)->GetInitialValue(), pred);
+		case ASTArrayExpr:
+			return AnyExpr(cast<ArrayExprAST>(expr)->GetSize(), pred);
+		case ASTIndexExpr:
+			return AnyExpr(cast<IndexExprAST>(expr)->GetIndex(), pred);
+		default:
+			return false;
+	}
+}
+
 #endif
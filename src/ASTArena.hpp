@@ -0,0 +1,55 @@
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/AlignOf.h"
+
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+
+#ifndef ASTARENA_HPP
+#define ASTARENA_HPP
+
+using namespace std;
+using namespace llvm;
+
+// Bump allocator owning every AST node of one top level item, together with
+// the strings and child lists the nodes refer to. Nodes must not own memory
+// themselves: they are never destroyed, the arena is just reset in one go.
+class ASTArena {
+	BumpPtrAllocator Allocator;
+
+public:
+	template<class T, class... Args>
+	T *Create(Args&&... args) {
+		void *mem = Allocator.Allocate(sizeof(T), AlignOf<T>::Alignment);
+		return new (mem) T(std::forward<Args>(args)...);
+	}
+
+	StringRef CopyString(StringRef str) {
+		char *mem = static_cast<char*>(Allocator.Allocate(str.size(), 1));
+		memcpy(mem, str.data(), str.size());
+		return StringRef(mem, str.size());
+	}
+
+	template<class T>
+	ArrayRef<T> CopyArray(ArrayRef<T> items) {
+		T *mem = static_cast<T*>(Allocator.Allocate(sizeof(T) * items.size(), AlignOf<T>::Alignment));
+		for (size_t i = 0; i < items.size(); ++i)
+			new (mem + i) T(items[i]);
+		return ArrayRef<T>(mem, items.size());
+	}
+
+	template<class T>
+	ArrayRef<T> CopyArray(const vector<T> &items) {
+		return this->CopyArray(ArrayRef<T>(items));
+	}
+
+	// release all nodes, keeping the first slab around for the next item
+	void Reset() {
+		Allocator.Reset();
+	}
+};
+
+#endif
@@ -0,0 +1,51 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+#include "BuiltIns.hpp"
+
+using namespace std;
+
+extern "C"
+double wait(double time) {
+	// what was printed before waiting is meant to be seen
+	pflush();
+	usleep(time);
+	return 0;
+}
+
+extern "C"
+double *wtf_alloc(int64_t length) {
+	// the size in bytes has to fit a size_t
+	if (length < 0 || (uint64_t) length > SIZE_MAX / sizeof(double)) {
+		pflush();
+		fprintf(stderr, "Cannot create an array of length %lld\n", (long long) length);
+		exit(1);
+	}
+
+	// cache line aligned, so vectorized loops start on a boundary
+	void *data = 0;
+	size_t size = length * sizeof(double);
+	if (posix_memalign( &data, 64, size ? size : 1) != 0) {
+		pflush();
+		fprintf(stderr, "Out of memory allocating an array of length %lld\n", (long long) length);
+		exit(1);
+	}
+
+	memset(data, 0, size);
+	return (double*) data;
+}
+
+extern "C"
+void wtf_free(double *data) {
+	free(data);
+}
+
+extern "C"
+void wtf_bounds_fail(double index, int64_t length) {
+	pflush();
+	fprintf(stderr, "Index %g out of bounds for array of length %lld\n", index, (long long) length);
+	exit(1);
+}
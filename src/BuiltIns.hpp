@@ -1,31 +1,35 @@
-#include <curses.h>
+#ifndef BUILTINS_HPP
+#define BUILTINS_HPP
 
-extern "C"
-double pchar(double ascii) {
-	cout << (char) ascii << flush;
-	return 0;
-}
+#include <stdint.h>
 
-extern "C"
-double pdoub(double num) {
-	cout << num << flush;
-	return 0;
-}
+// Runtime functions WTF programs reach through extern declarations. They are
+// linked into bin/wtf for the JIT and archived into bin/libwtfrt.a for
+// natively compiled programs.
+extern "C" {
+// output is buffered, see Output.cpp
+double pchar(double ascii);
+double pdoub(double num);
+double pline();
+double pflush();
+// a run of characters, or of values separated by spaces and ending a line
+double pchars(double *chars, int64_t length);
+double pvals(double *values, int64_t length);
+double wait(double time);
+double clrscr();
 
-extern "C"
-double pline() {
-	cout << '\n';
-	return 0;
-}
+// print(x, ...), generated code calls it with its values on the stack
+double wtf_print(double *values, int64_t count);
 
-extern "C"
-double wait(double time) {
-	usleep(time);
-	return 0;
-}
+// storage of WTF arrays, generated code calls these directly
+double *wtf_alloc(int64_t length);
+void wtf_free(double *data);
+void wtf_bounds_fail(double index, int64_t length) __attribute__((noreturn));
 
-extern "C"
-double clrscr() {
-	cout << "\x1b[H\x1b[2J";
-	return 0;
+// runs body over [0, count) on the thread pool, combining the values of its
+// chunks by reduction: 0 none, 1 sum, 2 min, 3 max (see Reduction in AST.hpp)
+double wtf_pfor(double (*body)(void *env, int64_t begin, int64_t end), void *env, int64_t count,
+		int32_t reduction);
 }
+
+#endif
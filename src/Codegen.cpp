@@ -1,40 +1,187 @@
 #include "Codegen.hpp"
 
+#include "llvm/Support/InstIterator.h"
+#include "llvm/Transforms/Vectorize.h"
+
+#include <limits>
+
 using namespace llvm;
 using namespace std;
 
-Codegen::Codegen(ExecutionEngine *execEngine, Module *module)
-		: Builder(getGlobalContext()) {
+// Hands function bodies to the JIT when it first needs them. Functions still
+// waiting for their body count as materializable, so the JIT calls them
+// through lazy compilation stubs instead of resolving them as externals.
+class LazyBodyMaterializer : public GVMaterializer {
+	Codegen *Gen;
+
+public:
+	LazyBodyMaterializer(Codegen *gen)
+			: Gen(gen) {
+	}
+
+	virtual bool isMaterializable(const GlobalValue *value) const {
+		const Function *func = dyn_cast<Function>(value);
+		return func && Gen->IsPending(func);
+	}
+
+	virtual bool isDematerializable(const GlobalValue *value) const {
+		return false;
+	}
+
+	virtual bool Materialize(GlobalValue *value, string *errInfo = 0) {
+		Function *func = dyn_cast<Function>(value);
+		if ( !func || !Gen->IsPending(func) || Gen->MaterializeBody(func))
+			return false;
+
+		if (errInfo)
+			*errInfo = "invalid body";
+		return true;
+	}
+
+	virtual bool MaterializeModule(Module *module, string *errInfo = 0) {
+		for (Module::iterator it = module->begin(); it != module->end(); ++it)
+			if (this->Materialize(it, errInfo))
+				return true;
+		return false;
+	}
+};
+
+Codegen::Codegen(CompilerSession &session, ExecutionEngine *execEngine, Module *module, unsigned optLevel)
+		: Diag(session.GetDiagnostics()), Builder(module->getContext()) {
 	InitializeNativeTarget();
 
 	TheModule = module;
 	ExecEngine = execEngine;
+	Eval = new Evaluator(module);
+	Lazy = false;
+	Recursion.Func = 0;
+	CheckedCopies = 0;
+
+	this->InitializePasses(ExecEngine->getDataLayout(), optLevel);
+	this->InitializeOperators();
+}
+
+Codegen::Codegen(CompilerSession &session, const DataLayout *layout, Module *module, unsigned optLevel)
+		: Diag(session.GetDiagnostics()), Builder(module->getContext()) {
+	TheModule = module;
+	ExecEngine = 0;
+	Eval = 0;
+	Lazy = false;
+	Recursion.Func = 0;
+	CheckedCopies = 0;
+
+	this->InitializePasses(layout, optLevel);
+	this->InitializeOperators();
+}
+
+Codegen::~Codegen() {
+	delete TheFPM;
+	delete TheMPM;
+	delete TheBatchFPM;
+	delete Eval;
+
+	for (map<const Function*, PendingBody>::iterator it = PendingBodies.begin(); it != PendingBodies.end(); ++it)
+		delete it->second.Arena;
+}
+
+CodeGenOpt::Level Codegen::CodeGenLevel(unsigned optLevel) {
+	switch (optLevel) {
+		case 0:
+			return CodeGenOpt::None;
+		case 1:
+			return CodeGenOpt::Less;
+		case 2:
+			return CodeGenOpt::Default;
+		default:
+			return CodeGenOpt::Aggressive;
+	}
+}
+
+// -O0 generates the code as is, -O1 cleans up each function on its own and
+// inlines operators, -O2 adds inlining and loop optimizations across the
+// whole module, which -O3 tunes for speed over code size and extends by
+// vectorization
+void Codegen::InitializePasses(const DataLayout *layout, unsigned optLevel) {
+	OptLevel = optLevel;
 
 	// Set up function optimization
 	TheFPM = new FunctionPassManager(TheModule);
-	TheFPM->add(new DataLayout( *ExecEngine->getDataLayout()));
-	TheFPM->add(createBasicAliasAnalysisPass());
-	TheFPM->add(createPromoteMemoryToRegisterPass());
-	TheFPM->add(createInstructionCombiningPass());
-	TheFPM->add(createReassociatePass());
-	TheFPM->add(createGVNPass());
-	TheFPM->add(createCFGSimplificationPass());
+	TheFPM->add(new DataLayout( *layout));
+	if (OptLevel > 0) {
+		TheFPM->add(createBasicAliasAnalysisPass());
+		TheFPM->add(createPromoteMemoryToRegisterPass());
+		TheFPM->add(createInstructionCombiningPass());
+		TheFPM->add(createReassociatePass());
+		TheFPM->add(createGVNPass());
+		TheFPM->add(createCFGSimplificationPass());
+	}
 	TheFPM->doInitialization();
+
+	TheMPM = 0;
+	TheBatchFPM = 0;
+	if (OptLevel == 0)
+		return;
+
+	// the loop of a batch is simple enough to vectorize at any level, its
+	// body has been optimized already
+	TheBatchFPM = new FunctionPassManager(TheModule);
+	TheBatchFPM->add(new DataLayout( *layout));
+	TheBatchFPM->add(createBasicAliasAnalysisPass());
+	TheBatchFPM->add(createInstructionCombiningPass());
+	// conditionals to selects, the vectorizer only takes single block loops
+	TheBatchFPM->add(createCFGSimplificationPass());
+	TheBatchFPM->add(createLoopVectorizePass());
+	TheBatchFPM->add(createInstructionCombiningPass());
+	TheBatchFPM->add(createCFGSimplificationPass());
+	TheBatchFPM->doInitialization();
+
+	if (OptLevel == 1) {
+		TheMPM = new PassManager();
+		TheMPM->add(createAlwaysInlinerPass());
+		return;
+	}
+
+	// Set up module optimization
+	PassManagerBuilder builder;
+	builder.OptLevel = OptLevel;
+	builder.Inliner = createFunctionInliningPass(OptLevel > 2 ? 275 : 225);
+	builder.Vectorize = OptLevel > 2;
+	builder.LoopVectorize = OptLevel > 2;
+
+	TheMPM = new PassManager();
+	TheMPM->add(new DataLayout( *layout));
+	builder.populateModulePassManager( *TheMPM);
 }
 
-AllocaInst *Codegen::CreateEntryBlockAlloca(Function *func, string varName) {
-	IRBuilder<> builder( &func->getEntryBlock(), func->getEntryBlock().begin());
-	return builder.CreateAlloca(Type::getDoubleTy(getGlobalContext()), 0, varName.c_str());
+void Codegen::InitializeOperators() {
+	InlineOperator none = { ArrayRef<StringRef>(), 0, false };
+	for (unsigned i = 0; i < 256; ++i) {
+		BinaryOps[i] = 0;
+		UnaryOps[i] = 0;
+		InlineBinaryOps[i] = none;
+		InlineUnaryOps[i] = none;
+	}
 }
 
-AllocaInst *Codegen::CreateEntryBlockAlloca(BasicBlock *block, string varName) {
-	IRBuilder<> builder(block, block->begin());
-	return builder.CreateAlloca(Type::getDoubleTy(getGlobalContext()), 0, varName.c_str());
+AllocaInst *Codegen::CreateEntryBlockAlloca(Function *func, StringRef varName, Type *type) {
+	IRBuilder<> builder( &func->getEntryBlock(), func->getEntryBlock().begin());
+	return builder.CreateAlloca(type ? type : Type::getDoubleTy(TheModule->getContext()), 0, varName);
 }
 
-void Codegen::CreateArgumentAllocas(vector<string> args, Function *func) {
+void Codegen::CreateArgumentAllocas(ArrayRef<StringRef> args, Function *func) {
 	Function::arg_iterator AI = func->arg_begin();
 	for (unsigned Idx = 0, e = args.size(); Idx != e; ++Idx, ++AI) {
+		// arrays come as data pointer and length
+		if (AI->getType()->isPointerTy()) {
+			AllocaInst *Alloca = this->CreateEntryBlockAlloca(func, args[Idx], this->GetArrayType());
+			Value *array = Builder.CreateInsertValue(UndefValue::get(this->GetArrayType()), AI, 0);
+			++AI;
+			array = Builder.CreateInsertValue(array, AI, 1);
+			Builder.CreateStore(array, Alloca);
+			NamedValues[args[Idx].str()] = Alloca;
+			continue;
+		}
+
 		// Create an alloca for this variable.
 		AllocaInst *Alloca = this->CreateEntryBlockAlloca(func, args[Idx]);
 
@@ -42,84 +189,117 @@ void Codegen::CreateArgumentAllocas(vector<string> args, Function *func) {
 		Builder.CreateStore(AI, Alloca);
 
 		// Add arguments to variable symbol table.
-		NamedValues[args[Idx]] = Alloca;
+		NamedValues[args[Idx].str()] = Alloca;
 	}
 }
 
-void Codegen::CreateArgumentAllocas(PrototypeAST *proto, Function *func) {
-	this->CreateArgumentAllocas(proto->GetArgs(), func);
-}
+// hands each kind of expression to its Generate overload
+class ExprGenerator : public ExprVisitor<ExprGenerator, Value*> {
+	Codegen &Gen;
+	Diagnostics &Diag;
+	bool Tail;
 
-Value *Codegen::Generate(ExprAST *expr) {
-	switch (expr->GetASTType()) {
-		case ASTNumberExpr:
-			return this->Generate((NumberExprAST *) expr);
-			break;
-		case ASTVariableExpr:
-			return this->Generate((VariableExprAST *) expr);
-			break;
-		case ASTBinaryExpr:
-			return this->Generate((BinaryExprAST *) expr);
-			break;
-		case ASTCallExpr:
-			return this->Generate((CallExprAST *) expr);
-			break;
-		case ASTConditionalExpr:
-			return this->Generate((ConditionalExprAST *) expr);
-			break;
-		case ASTForExpr:
-			return this->Generate((ForExprAST *) expr);
-			break;
-		case ASTUnary:
-			return this->Generate((UnaryExprAST *) expr);
-			break;
-		case ASTPrototype:
-			return this->Generate((PrototypeAST *) expr);
-			break;
-		case ASTFunction:
-			return this->Generate((FunctionAST *) expr);
-			break;
-		case ASTOperator:
-			return this->Generate((OperatorAST *) expr);
-			break;
-		case ASTVar:
-			return this->Generate((VarExprAST *) expr);
-			break;
-		case ASTBlock:
-			return 0;
+public:
+	ExprGenerator(Codegen &gen, Diagnostics &diag, bool tail)
+			: Gen(gen), Diag(diag), Tail(tail) {
+	}
+
+	Value *Visit(const NumberExprAST &expr) {
+		return Gen.Generate( &expr);
+	}
+	Value *Visit(const VariableExprAST &expr) {
+		return Gen.Generate( &expr);
+	}
+	Value *Visit(const BinaryExprAST &expr) {
+		return Gen.Generate( &expr);
+	}
+	Value *Visit(const CallExprAST &expr) {
+		return Gen.Generate( &expr, Tail);
+	}
+	Value *Visit(const ConditionalExprAST &expr) {
+		return Gen.Generate( &expr, Tail);
+	}
+	Value *Visit(const ForExprAST &expr) {
+		return Gen.Generate( &expr);
+	}
+	Value *Visit(const UnaryExprAST &expr) {
+		return Gen.Generate( &expr);
 	}
+	Value *Visit(const VarExprAST &expr) {
+		return Gen.Generate( &expr);
+	}
+	Value *Visit(const ArrayExprAST &) {
+		return Diag.Throw<Value*>("Arrays can only be created in a 'var' declaration");
+	}
+	Value *Visit(const IndexExprAST &expr) {
+		return Gen.Generate( &expr);
+	}
+};
+
+Value *Codegen::Generate(const ExprAST *expr, bool tail) {
+	return ExprGenerator( *this, Diag, tail).Dispatch( *expr);
 }
 
-Value *Codegen::Generate(NumberExprAST *expr) {
-	return ConstantFP::get(getGlobalContext(), APFloat(expr->GetVal()));
+Value *Codegen::Generate(const NumberExprAST *expr) {
+	return ConstantFP::get(TheModule->getContext(), APFloat(expr->GetVal()));
 }
 
-Value *Codegen::Generate(VariableExprAST *expr) {
-	string name = expr->GetName();
-	AllocaInst *alloca = NamedValues[name];
+Value *Codegen::Generate(const VariableExprAST *expr) {
+	StringRef name = expr->GetName();
+	AllocaInst *alloca = NamedValues[name.str()];
 
 	if (alloca == 0)
-		return BaseError::Throw<Value*>(str(boost::format("Unknown variable '%1%'") % name).c_str());
+		return Diag.Throw<Value*>(str(boost::format("Unknown variable '%1%'") % name.str()));
 
-	return Builder.CreateLoad(alloca, name.c_str()); // XXX remove c_str
+	if (alloca->getAllocatedType() == this->GetArrayType())
+		return Diag.Throw<Value*>(str(boost::format("'%1%' is an array, index it or use len(%1%)") % name.str()));
+
+	return Builder.CreateLoad(alloca, name);
 }
 
-Value *Codegen::Generate(BinaryExprAST *expr) {
+Value *Codegen::Generate(const BinaryExprAST *expr) {
 	using namespace boost;
 
 	// treat assignment separately
+	if (expr->GetOp() == '=' && isa<IndexExprAST>(expr->GetLHS())) {
+		Value *val = this->Generate(expr->GetRHS());
+		if ( !val)
+			return Diag.Throw<Value*>("Invalid assignment value to array element");
+		if ( !this->Scalar(val, "Array element"))
+			return 0;
+
+		Value *element = this->GenerateElementPointer(cast<IndexExprAST>(expr->GetLHS()));
+		if ( !element)
+			return 0;
+
+		Builder.CreateStore(val, element);
+		return val;
+	}
+
 	if (expr->GetOp() == '=') {
-		VariableExprAST *identifier = dynamic_cast<VariableExprAST*>(expr->GetLHS());
+		VariableExprAST *identifier = dyn_cast<VariableExprAST>(expr->GetLHS());
 		if ( !identifier)
-			return BaseError::Throw<Value*>("Left hand of assignment must be a variable");
+			return Diag.Throw<Value*>("Left hand of assignment must be a variable");
 
 		Value *val = this->Generate(expr->GetRHS());
 		if ( !val)
-			return BaseError::Throw<Value*>("Invalid assignment value to variable");
+			return Diag.Throw<Value*>("Invalid assignment value to variable");
 
-		Value *variable = NamedValues[identifier->GetName()];
+		Value *variable = NamedValues[identifier->GetName().str()];
 		if ( !variable)
-			return BaseError::Throw<Value*>("Unknown variable, cannot assign");
+			return Diag.Throw<Value*>("Unknown variable, cannot assign");
+
+		Type *type = cast<AllocaInst>(variable)->getAllocatedType();
+		if (type == this->GetArrayType())
+			return Diag.Throw<Value*>("Arrays cannot be assigned, only their elements");
+
+		// a vec variable assigned a scalar gets it in every lane
+		if (type->isVectorTy()) {
+			if ( !val->getType()->isVectorTy())
+				val = this->Splat(val);
+		}
+		else if ( !this->Scalar(val, "'" + identifier->GetName().str() + "'"))
+			return 0;
 
 		Builder.CreateStore(val, variable);
 		return val;
@@ -131,7 +311,16 @@ Value *Codegen::Generate(BinaryExprAST *expr) {
 	if (L == 0 || R == 0)
 		return 0;
 
-	switch (expr->GetOp()) {
+	// a scalar meeting a vec is used for every lane
+	if (L->getType() != R->getType()) {
+		if (L->getType()->isVectorTy())
+			R = this->Splat(R);
+		else
+			L = this->Splat(L);
+	}
+
+	char op = expr->GetOp();
+	switch (op) {
 		case '+':
 			return Builder.CreateFAdd(L, R, "addtmp");
 		case '-':
@@ -141,84 +330,190 @@ Value *Codegen::Generate(BinaryExprAST *expr) {
 		case '/':
 			return Builder.CreateFDiv(L, R, "divtmp");
 		case '<':
+			// vecs compare lane by lane into a mask of 0s and 1s
 			L = Builder.CreateFCmpULT(L, R, "cmptmp");
-			return Builder.CreateUIToFP(L, Type::getDoubleTy(getGlobalContext()), "booltmp");
+			return Builder.CreateUIToFP(L, R->getType(), "booltmp");
 		default:
 			break;
 	}
 
-	Function *opFunc = TheModule->getFunction("binary" + expr->GetOp());
+	Value *args[2] = { L, R };
+
+	InlineOperator &inlineOp = InlineBinaryOps[(unsigned char) op];
+	if (inlineOp.Body && !inlineOp.Active)
+		return this->GenerateInline(inlineOp, args);
+
+	Function *opFunc = this->GetOperatorFunction(true, op);
 	if ( !opFunc)
-		return BaseError::Throw<Value*>(str(format("Unknown binary operator '%1%'") % expr->GetOp()));
+		return Diag.Throw<Value*>(str(format("Unknown binary operator '%1%'") % op));
+	if ( !this->Scalar(L, str(format("Operand of '%1%'") % op)))
+		return 0;
 
-	Value *args[2] = { L, R };
 	return Builder.CreateCall(opFunc, args, "binop");
 }
 
-Value *Codegen::Generate(CallExprAST *expr) {
+// vec(x) and vec(a, b, c, d) build vecs, lane(v, i) and setlane(v, i, x)
+// read and replace a lane, hsum, hmin and hmax reduce one to a double
+static bool IsVectorBuiltin(StringRef name, size_t arity) {
+	if (name == "vec")
+		return arity == 1 || arity == Codegen::VectorWidth;
+	if (name == "lane")
+		return arity == 2;
+	if (name == "setlane")
+		return arity == 3;
+	return (name == "hsum" || name == "hmin" || name == "hmax") && arity == 1;
+}
+
+// sqrt, sin, cos, exp, log, pow, fabs, floor and fma are the LLVM intrinsics,
+// which take vecs as well as doubles
+static Intrinsic::ID GetMathIntrinsic(StringRef name, size_t arity) {
+	if (arity == 1) {
+		if (name == "sqrt")
+			return Intrinsic::sqrt;
+		if (name == "sin")
+			return Intrinsic::sin;
+		if (name == "cos")
+			return Intrinsic::cos;
+		if (name == "exp")
+			return Intrinsic::exp;
+		if (name == "log")
+			return Intrinsic::log;
+		if (name == "fabs")
+			return Intrinsic::fabs;
+		if (name == "floor")
+			return Intrinsic::floor;
+	}
+	if (name == "pow" && arity == 2)
+		return Intrinsic::pow;
+	if (name == "fma" && arity == 3)
+		return Intrinsic::fma;
+	return Intrinsic::not_intrinsic;
+}
+
+Value *Codegen::Generate(const CallExprAST *expr, bool tail) {
 	using namespace boost;
 
-	string callee = expr->GetCallee();
-	vector<ExprAST*> args = expr->GetArgs();
+	StringRef callee = expr->GetCallee();
+	ArrayRef<ExprAST*> args = expr->GetArgs();
+
+	// length of an array
+	if (callee == "len" && args.size() == 1 && isa<VariableExprAST>(args[0]))
+		if (AllocaInst *array = this->LookupArray(cast<VariableExprAST>(args[0])->GetName())) {
+			Value *length = Builder.CreateExtractValue(Builder.CreateLoad(array), 1, "length");
+			return Builder.CreateSIToFP(length, Type::getDoubleTy(TheModule->getContext()), "len");
+		}
 
 	Function *CalleeF = TheModule->getFunction(callee);
+	// the vec builtins, unless the program defines the name itself
+	if (CalleeF == 0 && IsVectorBuiltin(callee, args.size()))
+		return this->GenerateVectorBuiltin(callee, args);
+	if (CalleeF == 0 && callee == "print")
+		return this->GeneratePrint(args);
+	// the math builtins, unless the program gives the name a body. An extern
+	// of the C function is only a declaration, the intrinsic stands for it.
+	Intrinsic::ID intrinsic = GetMathIntrinsic(callee, args.size());
+	if (intrinsic != Intrinsic::not_intrinsic && (CalleeF == 0 || (CalleeF->empty()
+			&& !CalleeF->isMaterializable() && CalleeF->arg_size() == args.size())))
+		return this->GenerateMathBuiltin(intrinsic, callee, args);
 	if (CalleeF == 0)
-		return BaseError::Throw<Value*>(str(format("Unknown function '%1%'") % callee));
+		return Diag.Throw<Value*>(str(format("Unknown function '%1%'") % callee.str()));
+
+	// array arguments take a pointer and a length parameter
+	vector<ArgKind> kinds;
+	for (Function::arg_iterator it = CalleeF->arg_begin(); it != CalleeF->arg_end(); ++it) {
+		kinds.push_back(it->getType()->isPointerTy() ? ArrayArg : ScalarArg);
+		if (kinds.back() == ArrayArg)
+			++it;
+	}
 
-	if (CalleeF->arg_size() != args.size())
-		return BaseError::Throw<Value*>(str(boost::format("Wrong number of arguments in function %1%; got %2%, %3% expected")
-				% callee.c_str()
+	if (kinds.size() != args.size())
+		return Diag.Throw<Value*>(str(boost::format("Wrong number of arguments in function %1%; got %2%, %3% expected")
+				% callee.str()
 				% args.size()
-				% CalleeF->arg_size()));
+				% kinds.size()));
 
+	// one value per argument, arrays as a whole
 	vector<Value*> ArgsV;
 	for (unsigned i = 0, e = args.size(); i != e; ++i) {
-		Value *arg = this->Generate(args[i]);
+		if (kinds[i] == ArrayArg) {
+			VariableExprAST *var = dyn_cast<VariableExprAST>(args[i]);
+			AllocaInst *array = var ? this->LookupArray(var->GetName()) : 0;
+			if ( !array)
+				return Diag.Throw<Value*>(str(format("Argument %1% of %2% must be an array") % (i + 1) % callee.str()));
+
+			ArgsV.push_back(Builder.CreateLoad(array, var->GetName()));
+			continue;
+		}
+
+		Value *arg = this->Scalar(this->Generate(args[i]), str(format("Argument %1% of %2%") % (i + 1) % callee.str()));
 		ArgsV.push_back(arg);
 		if (ArgsV.back() == 0)
 			return 0;
 	}
 
-	ArrayRef<Value*> *argArr = new ArrayRef<Value*>(ArgsV);
-	return Builder.CreateCall(CalleeF, *argArr, "tmpcall");
+	// recursing from tail position loops back to the start of the body, the
+	// block is left so there is no value
+	if (tail && CalleeF == Recursion.Func) {
+		for (unsigned i = 0; i < ArgsV.size(); ++i)
+			Builder.CreateStore(ArgsV[i], Recursion.Args[i]);
+		Builder.CreateBr(Recursion.Block);
+		return UndefValue::get(Type::getDoubleTy(TheModule->getContext()));
+	}
+
+	vector<Value*> params;
+	for (unsigned i = 0; i < ArgsV.size(); ++i) {
+		if (kinds[i] == ArrayArg) {
+			params.push_back(Builder.CreateExtractValue(ArgsV[i], 0));
+			params.push_back(Builder.CreateExtractValue(ArgsV[i], 1));
+		}
+		else
+			params.push_back(ArgsV[i]);
+	}
+
+	CallInst *call = Builder.CreateCall(CalleeF, params, "tmpcall");
+	// arguments never point into this frame, the callee can reuse it
+	call->setTailCall(tail);
+	return call;
 }
 
-Value *Codegen::Generate(ConditionalExprAST *expr) {
-	vector<ConditionalElement*> conds = expr->GetConds();
+Value *Codegen::Generate(const ConditionalExprAST *expr, bool tail) {
+	ArrayRef<ConditionalElement> conds = expr->GetConds();
 
 	Function *func = Builder.GetInsertBlock()->getParent();
-	BasicBlock *mergeBlock = BasicBlock::Create(getGlobalContext(), "merge");
-	BasicBlock *entryBlock = Builder.GetInsertBlock();
+	BasicBlock *mergeBlock = BasicBlock::Create(TheModule->getContext(), "merge");
 
-	// return value will be determined using a phi node in the merge block
-	Builder.SetInsertPoint(mergeBlock);
-	PHINode *phi = Builder.CreatePHI(Type::getDoubleTy(getGlobalContext()), conds.size(), "iftmp");
-
-	Builder.SetInsertPoint(entryBlock);
+	// return value will be determined using a phi node in the merge block,
+	// typed once the branches are known to agree on double or vec
+	vector<pair<Value*, BasicBlock*> > incoming;
 
 	for (int i = 0; i < conds.size(); ++i) {
-		ConditionalElement *elm = conds[i];
+		const ConditionalElement &elm = conds[i];
 
 		// emit condition
-		Value *condVal = this->Generate(elm->GetCond());
-		condVal = Builder.CreateFCmpONE(condVal, ConstantFP::get(getGlobalContext(), APFloat(0.0)), "ifcond");
+		Value *condVal = this->Generate(elm.GetCond());
 		if (condVal == 0)
-			return BaseError::Throw<Value*>("Condition is undefined");
+			return Diag.Throw<Value*>("Condition is undefined");
+		if ( !this->Scalar(condVal, "Condition"))
+			return 0;
+		condVal = Builder.CreateFCmpONE(condVal, ConstantFP::get(TheModule->getContext(), APFloat(0.0)), "ifcond");
 
-		BasicBlock *condBlock = BasicBlock::Create(getGlobalContext(), "then");
-		BasicBlock *nextBlock = BasicBlock::Create(getGlobalContext(), "else");
+		BasicBlock *condBlock = BasicBlock::Create(TheModule->getContext(), "then");
+		BasicBlock *nextBlock = BasicBlock::Create(TheModule->getContext(), "else");
 
 		// branch into body if condition is met, else skip to next conditional element
 		Builder.CreateCondBr(condVal, condBlock, nextBlock);
 
 		// emit body code into conditional block
 		Builder.SetInsertPoint(condBlock);
-		Value *condBody = this->Generate(elm->GetConsequence());
-		// merge back into main flow
-		Builder.CreateBr(mergeBlock);
+		Value *condBody = this->Generate(elm.GetConsequence(), tail);
+		if (condBody == 0)
+			return 0;
 
-		// add value to phi
-		phi->addIncoming(condBody, condBlock);
+		// merge back into main flow, unless a tail call already jumped away
+		if ( !Builder.GetInsertBlock()->getTerminator()) {
+			incoming.push_back(make_pair(condBody, Builder.GetInsertBlock()));
+			Builder.CreateBr(mergeBlock);
+		}
 
 		// push conditional block into func
 		func->getBasicBlockList().push_back(condBlock);
@@ -228,39 +523,141 @@ Value *Codegen::Generate(ConditionalExprAST *expr) {
 	}
 
 	// 'else' block
-	Value *elseVal = this->Generate(expr->GetElse());
+	Value *elseVal = this->Generate(expr->GetElse(), tail);
 	if (elseVal == 0)
-		return BaseError::Throw<Value*>("'else' value is undefined");
+		return Diag.Throw<Value*>("'else' value is undefined");
 
-	Builder.CreateBr(mergeBlock);
-	//elseBlock = Builder.GetInsertBlock();
-
-	// add else value to phi
-	phi->addIncoming(elseVal, Builder.GetInsertBlock());
+	if ( !Builder.GetInsertBlock()->getTerminator()) {
+		incoming.push_back(make_pair(elseVal, Builder.GetInsertBlock()));
+		Builder.CreateBr(mergeBlock);
+	}
 
 	func->getBasicBlockList().push_back(mergeBlock);
 
 	Builder.SetInsertPoint(mergeBlock);
 
+	// every branch recursed, the merge block is never reached
+	if (incoming.empty())
+		return UndefValue::get(Type::getDoubleTy(TheModule->getContext()));
+
+	Type *type = incoming[0].first->getType();
+	PHINode *phi = Builder.CreatePHI(type, incoming.size(), "iftmp");
+	for (unsigned i = 0; i < incoming.size(); ++i) {
+		if (incoming[i].first->getType() != type)
+			return Diag.Throw<Value*>("Branches of a conditional must all give doubles or all give vecs");
+		phi->addIncoming(incoming[i].first, incoming[i].second);
+	}
+
 //	func->viewCFG();
 
 	return phi;
 }
 
-Value *Codegen::Generate(ForExprAST *expr) {
-	string iterName = expr->GetIterName();
+// matches expressions that may store to the variable called name
+struct AssignsTo {
+	StringRef Name;
+
+	AssignsTo(StringRef name)
+			: Name(name) {
+	}
+
+	bool operator()(const ExprAST *expr) const {
+		if (const BinaryExprAST *binary = dyn_cast<BinaryExprAST>(expr)) {
+			const VariableExprAST *target = dyn_cast<VariableExprAST>(binary->GetLHS());
+			return binary->GetOp() == '=' && target && target->GetName() == Name;
+		}
+		// redeclaring the name rebinds it for the rest of the function
+		if (const VarExprAST *var = dyn_cast<VarExprAST>(expr))
+			return var->GetName() == Name;
+		if (const ForExprAST *loop = dyn_cast<ForExprAST>(expr))
+			return loop->GetIterName() == Name;
+		return false;
+	}
+};
+
+static bool Assigns(const BlockAST *block, StringRef name) {
+	return AnyExpr(block, AssignsTo(name));
+}
+
+struct AllocatesArray {
+	bool operator()(const ExprAST *expr) const {
+		return isa<ArrayExprAST>(expr);
+	}
+};
+
+static bool IsSmallInteger(const ExprAST *expr, int64_t &val) {
+	const NumberExprAST *number = dyn_cast_or_null<NumberExprAST>(expr);
+	if ( !number)
+		return false;
+
+	double num = number->GetVal();
+	if (num != (int64_t) num || num < -2147483648.0 || num > 2147483647.0)
+		return false;
+
+	val = (int64_t) num;
+	return true;
+}
+
+// a loop can count with an integer if it starts at an integer literal, steps
+// by a positive one and runs while the iterator is below a literal, or a
+// variable or len() of one the body leaves alone
+static bool IsCountedLoop(const ForExprAST *expr, int64_t &init, int64_t &step, ExprAST *&bound) {
+	StringRef iter = expr->GetIterName();
+
+	step = 1;
+	if ( !IsSmallInteger(expr->GetInit(), init)
+			|| (expr->GetStep() && !IsSmallInteger(expr->GetStep(), step)) || step <= 0)
+		return false;
+
+	const BinaryExprAST *cond = dyn_cast_or_null<BinaryExprAST>(expr->GetEnd());
+	if ( !cond || cond->GetOp() != '<')
+		return false;
+
+	const VariableExprAST *lhs = dyn_cast<VariableExprAST>(cond->GetLHS());
+	if ( !lhs || lhs->GetName() != iter || Assigns(expr->GetBody(), iter))
+		return false;
+
+	bound = cond->GetRHS();
+	if (isa<NumberExprAST>(bound))
+		return true;
+
+	const VariableExprAST *var = dyn_cast<VariableExprAST>(bound);
+	if (const CallExprAST *call = dyn_cast<CallExprAST>(bound))
+		if (call->GetCallee() == "len" && call->GetArgs().size() == 1)
+			var = dyn_cast<VariableExprAST>(call->GetArgs()[0]);
+
+	return var && var->GetName() != iter && !Assigns(expr->GetBody(), var->GetName());
+}
+
+Value *Codegen::Generate(const ForExprAST *expr) {
+	if (expr->IsParallel())
+		return this->GenerateParallelLoop(expr);
+
+	int64_t init, step;
+	ExprAST *bound;
+	// as long as len() is the builtin one
+	if ( !CheckedCopies && IsCountedLoop(expr, init, step, bound) && ( !isa<CallExprAST>(bound)
+			|| this->LookupArray(cast<VariableExprAST>(cast<CallExprAST>(bound)->GetArgs()[0])->GetName())))
+		return this->GenerateCountedLoop(expr, init, step, bound);
+
+	return this->GenerateLoop(expr);
+}
+
+// the body, step and condition as they are written, iterating on a double
+Value *Codegen::GenerateLoop(const ForExprAST *expr) {
+	string iterName = expr->GetIterName().str();
 	Function *func = Builder.GetInsertBlock()->getParent();
 
 	// create an alloca for the iterated variable
-	AllocaInst *alloca = this->CreateEntryBlockAlloca(func, iterName.c_str());
+	AllocaInst *alloca = this->CreateEntryBlockAlloca(func, iterName);
 
-	Value *initVal = this->Generate(expr->GetInit());
+	Value *initVal = this->Scalar(this->Generate(expr->GetInit()), "Loop start");
 	if (initVal == 0)
 		return 0;
 
 	Builder.CreateStore(initVal, alloca);
 
-	BasicBlock *loopBlock = BasicBlock::Create(getGlobalContext(), "loop", func);
+	BasicBlock *loopBlock = BasicBlock::Create(TheModule->getContext(), "loop", func);
 
 	Builder.CreateBr(loopBlock);
 	Builder.SetInsertPoint(loopBlock);
@@ -277,27 +674,27 @@ Value *Codegen::Generate(ForExprAST *expr) {
 	// handle step
 	Value *stepVal;
 	if (expr->GetStep()) {
-		stepVal = this->Generate(expr->GetStep());
+		stepVal = this->Scalar(this->Generate(expr->GetStep()), "Loop step");
 		if (stepVal == 0)
 			return 0;
 	}
 	// if step is not specified, use ++
 	else {
-		stepVal = ConstantFP::get(getGlobalContext(), APFloat(1.0));
+		stepVal = ConstantFP::get(TheModule->getContext(), APFloat(1.0));
 	}
 
-	Value *endCond = this->Generate(expr->GetEnd());
+	Value *endCond = this->Scalar(this->Generate(expr->GetEnd()), "Loop condition");
 	if (endCond == 0)
 		return 0;
 
-	Value *currentVal = Builder.CreateLoad(alloca, iterName.c_str());
+	Value *currentVal = Builder.CreateLoad(alloca, iterName);
 	Value *nextVal = Builder.CreateFAdd(currentVal, stepVal, "nextvar");
 	Builder.CreateStore(nextVal, alloca);
 
 	// booleanize end condition
-	endCond = Builder.CreateFCmpONE(endCond, ConstantFP::get(getGlobalContext(), APFloat(0.0)), "loopcond");
+	endCond = Builder.CreateFCmpONE(endCond, ConstantFP::get(TheModule->getContext(), APFloat(0.0)), "loopcond");
 
-	BasicBlock *afterBlock = BasicBlock::Create(getGlobalContext(), "afterloop", func);
+	BasicBlock *afterBlock = BasicBlock::Create(TheModule->getContext(), "afterloop", func);
 
 	// create the loop ending branch
 	Builder.CreateCondBr(endCond, loopBlock, afterBlock);
@@ -314,13 +711,637 @@ Value *Codegen::Generate(ForExprAST *expr) {
 	return bodyVal;
 }
 
+// Like other loops the body runs before the condition is checked, so it
+// sees init, init + step, ... up to the first value that is not below the
+// bound. The count is worked out in the preheader, where it is constant for
+// a literal bound, and the loop runs on an i64 induction variable that the
+// loop passes can analyze.
+//
+// Accesses ProveInBounds covers are not checked in the body. The preheader
+// tests their ranges together and, when one does not fit, runs a plain copy
+// of the loop with every check in place instead, which fails at the same
+// iteration the loop would without the proof.
+Value *Codegen::GenerateCountedLoop(const ForExprAST *expr, int64_t init, int64_t step, const ExprAST *bound) {
+	LLVMContext &context = TheModule->getContext();
+	Type *doubleTy = Type::getDoubleTy(context);
+	Type *intTy = Type::getInt64Ty(context);
+
+	string iterName = expr->GetIterName().str();
+	Function *func = Builder.GetInsertBlock()->getParent();
+
+	AllocaInst *alloca = this->CreateEntryBlockAlloca(func, iterName);
+
+	Value *boundVal = this->Scalar(this->Generate(bound), "Loop bound");
+	if (boundVal == 0)
+		return 0;
+
+	// steps after the first, ceil((bound - init) / step) clamped so the last
+	// value fits. i < NaN holds, so a NaN bound gets the most steps, as an
+	// infinite one does. Neither loop ends, the same as with a double
+	// iterator, and the iterator takes the same values on the way.
+	Value *steps = Builder.CreateFDiv(
+			Builder.CreateFSub(boundVal, ConstantFP::get(doubleTy, (double) init)),
+			ConstantFP::get(doubleTy, (double) step), "steps");
+	Constant *maxSteps = ConstantFP::get(doubleTy, 4611686018427387904.0 / step);
+	Constant *zero = ConstantFP::get(doubleTy, 0.0);
+	steps = Builder.CreateSelect(Builder.CreateFCmpOLE(steps, zero), zero, steps);
+	steps = Builder.CreateSelect(Builder.CreateFCmpOLT(steps, maxSteps), steps, maxSteps);
+
+	Value *count = Builder.CreateFPToSI(steps, intTy, "count");
+	Value *truncated = Builder.CreateFCmpOLT(Builder.CreateSIToFP(count, doubleTy), steps);
+	count = Builder.CreateAdd(count, Builder.CreateZExt(truncated, intTy), "count");
+
+	Value *initVal = ConstantInt::get(intTy, init);
+	Value *stepVal = ConstantInt::get(intTy, step);
+	Value *last = Builder.CreateAdd(initVal, Builder.CreateMul(count, stepVal), "last");
+
+	BasicBlock *preheader = Builder.GetInsertBlock();
+	BasicBlock *header = BasicBlock::Create(context, "loop", func);
+	// replaced by the choice of copy once the body is generated
+	Builder.CreateBr(header);
+	Builder.SetInsertPoint(header);
+
+	PHINode *iv = Builder.CreatePHI(intTy, 2, iterName + ".iv");
+	iv->addIncoming(initVal, preheader);
+	Builder.CreateStore(Builder.CreateSIToFP(iv, doubleTy), alloca);
+
+	// the variables a checked copy starts from
+	map<string, AllocaInst*> namedValues = NamedValues;
+
+	// save old value of same name as IterName (if any)
+	AllocaInst *oldVal = NamedValues[iterName];
+	NamedValues[iterName] = alloca;
+
+	CountedLoop loop;
+	loop.Iter = alloca;
+	loop.Body = expr->GetBody();
+	loop.Preheader = preheader;
+	loop.First = init;
+	loop.Last = last;
+
+	CountedLoops.push_back( &loop);
+	Value *bodyVal = this->Generate(expr->GetBody());
+	CountedLoops.pop_back();
+
+	if (bodyVal == 0)
+		return 0;
+
+	BasicBlock *latch = BasicBlock::Create(context, "loopend", func);
+	Builder.CreateBr(latch);
+	Builder.SetInsertPoint(latch);
+
+	Value *next = Builder.CreateNSWAdd(iv, stepVal, "nextvar");
+	iv->addIncoming(next, latch);
+	Value *endCond = Builder.CreateICmpSLT(iv, last, "loopcond");
+
+	BasicBlock *afterBlock = BasicBlock::Create(context, "afterloop", func);
+	Builder.CreateCondBr(endCond, header, afterBlock);
+	Builder.SetInsertPoint(afterBlock);
+
+	// restore the saved variable
+	if (oldVal)
+		NamedValues[iterName] = oldVal;
+	else
+		NamedValues.erase(iterName);
+
+	if (loop.InBounds.empty())
+		return bodyVal;
+
+	// this copy runs when every proven range fits, the checked one otherwise
+	BasicBlock *checked = BasicBlock::Create(context, "loopchecked", func);
+	preheader->getTerminator()->eraseFromParent();
+	IRBuilder<> builder(preheader);
+	map<pair<AllocaInst*, int64_t>, Value*>::iterator it = loop.InBounds.begin();
+	Value *fits = it->second;
+	for (++it; it != loop.InBounds.end(); ++it)
+		fits = builder.CreateAnd(fits, it->second);
+	builder.CreateCondBr(fits, header, checked);
+
+	map<string, AllocaInst*> uncheckedValues;
+	uncheckedValues.swap(NamedValues);
+	NamedValues = namedValues;
+
+	Builder.SetInsertPoint(checked);
+	++CheckedCopies;
+	Value *checkedVal = this->GenerateLoop(expr);
+	--CheckedCopies;
+	if (checkedVal == 0)
+		return 0;
+	BasicBlock *checkedEnd = Builder.GetInsertBlock();
+	BasicBlock *join = BasicBlock::Create(context, "afterloop", func);
+	Builder.CreateBr(join);
+
+	// variables declared in the body outlive the loop, the checked copy's
+	// are the ones code after it uses. Arrays move, so only one copy frees.
+	Builder.SetInsertPoint(afterBlock);
+	for (map<string, AllocaInst*>::iterator var = NamedValues.begin(); var != NamedValues.end(); ++var) {
+		map<string, AllocaInst*>::iterator own = uncheckedValues.find(var->first);
+		if (own == uncheckedValues.end() || !own->second || !var->second || own->second == var->second
+				|| own->second->getAllocatedType() != var->second->getAllocatedType())
+			continue;
+		Builder.CreateStore(Builder.CreateLoad(own->second), var->second);
+		if (own->second->getAllocatedType() == this->GetArrayType())
+			Builder.CreateStore(Constant::getNullValue(this->GetArrayType()), own->second);
+	}
+	Builder.CreateBr(join);
+
+	Builder.SetInsertPoint(join);
+	if (bodyVal->getType() != checkedVal->getType())
+		return checkedVal;
+	PHINode *val = Builder.CreatePHI(bodyVal->getType(), 2, "loopval");
+	val->addIncoming(bodyVal, afterBlock);
+	val->addIncoming(checkedVal, checkedEnd);
+	return val;
+}
+
+// collects the names of the variables and arrays expressions refer to
+struct CollectNames {
+	set<string> *Names;
+
+	CollectNames(set<string> *names)
+			: Names(names) {
+	}
+
+	bool operator()(const ExprAST *expr) const {
+		if (const VariableExprAST *var = dyn_cast<VariableExprAST>(expr))
+			Names->insert(var->GetName().str());
+		else if (const IndexExprAST *index = dyn_cast<IndexExprAST>(expr))
+			Names->insert(index->GetName().str());
+		return false;
+	}
+};
+
+// The body of a pfor is outlined into a function running a chunk of the
+// iterations, which wtf_pfor hands to the thread pool. Variables the body
+// uses are copied into an environment, so every chunk works on its own
+// copies while array elements are shared. Unlike other loops a pfor runs
+// zero times when its range is empty. Its value is the reduction of the
+// body values, or 0 without one.
+Value *Codegen::GenerateParallelLoop(const ForExprAST *expr) {
+	LLVMContext &context = TheModule->getContext();
+	Type *doubleTy = Type::getDoubleTy(context);
+	Type *intTy = Type::getInt64Ty(context);
+	Type *envPtrTy = Type::getInt8PtrTy(context);
+	Function *func = Builder.GetInsertBlock()->getParent();
+	string iterName = expr->GetIterName().str();
+	Reduction reduce = expr->GetReduction();
+
+	Value *start = this->Scalar(this->Generate(expr->GetInit()), "Loop start");
+	if (start == 0)
+		return 0;
+	Value *bound = this->Scalar(this->Generate(cast<BinaryExprAST>(expr->GetEnd())->GetRHS()), "Loop bound");
+	if (bound == 0)
+		return 0;
+	Value *step = ConstantFP::get(doubleTy, 1.0);
+	if (expr->GetStep()) {
+		step = this->Scalar(this->Generate(expr->GetStep()), "Loop step");
+		if (step == 0)
+			return 0;
+	}
+
+	// ceil((bound - start) / step) iterations, none for NaN or a step that
+	// does not go up
+	Constant *zero = ConstantFP::get(doubleTy, 0.0);
+	Constant *maxSteps = ConstantFP::get(doubleTy, 4611686018427387904.0);
+	Value *steps = Builder.CreateFDiv(Builder.CreateFSub(bound, start), step, "steps");
+	steps = Builder.CreateSelect(Builder.CreateFCmpOGT(steps, zero), steps, zero);
+	steps = Builder.CreateSelect(Builder.CreateFCmpOGT(step, zero), steps, zero);
+	steps = Builder.CreateSelect(Builder.CreateFCmpOLT(steps, maxSteps), steps, maxSteps);
+	Value *count = Builder.CreateFPToSI(steps, intTy, "count");
+	Value *truncated = Builder.CreateFCmpOLT(Builder.CreateSIToFP(count, doubleTy), steps);
+	count = Builder.CreateAdd(count, Builder.CreateZExt(truncated, intTy), "count");
+
+	// the environment holds start, step and the captured variables
+	set<string> names;
+	AnyExpr(expr->GetBody(), CollectNames( &names));
+	vector<string> captured;
+	vector<Type*> fields;
+	fields.push_back(doubleTy);
+	fields.push_back(doubleTy);
+	for (set<string>::iterator it = names.begin(); it != names.end(); ++it) {
+		map<string, AllocaInst*>::iterator var = NamedValues.find( *it);
+		if ( *it == iterName || var == NamedValues.end() || !var->second)
+			continue;
+		captured.push_back( *it);
+		fields.push_back(var->second->getAllocatedType());
+	}
+
+	StructType *envType = StructType::get(context, fields);
+	AllocaInst *env = this->CreateEntryBlockAlloca(func, "pfor.env", envType);
+	Builder.CreateStore(start, Builder.CreateStructGEP(env, 0));
+	Builder.CreateStore(step, Builder.CreateStructGEP(env, 1));
+	for (unsigned i = 0; i < captured.size(); ++i)
+		Builder.CreateStore(Builder.CreateLoad(NamedValues[captured[i]]), Builder.CreateStructGEP(env, i + 2));
+
+	Type *params[3] = { envPtrTy, intTy, intTy };
+	FunctionType *chunkType = FunctionType::get(doubleTy, params, false);
+	Function *chunk = Function::Create(chunkType, Function::InternalLinkage, func->getName() + ".pfor", TheModule);
+
+	// the chunk function is generated on its own, as MaterializeBody does
+	IRBuilderBase::InsertPoint insertPoint = Builder.saveIP();
+	map<string, AllocaInst*> namedValues;
+	namedValues.swap(NamedValues);
+	TailRecursion recursion = Recursion;
+	Recursion.Func = 0;
+	vector<AllocaInst*> ownedArrays;
+	ownedArrays.swap(OwnedArrays);
+	vector<CountedLoop*> countedLoops;
+	countedLoops.swap(CountedLoops);
+	unsigned checkedCopies = CheckedCopies;
+	CheckedCopies = 0;
+
+	Function::arg_iterator args = chunk->arg_begin();
+	Value *chunkEnv = args++;
+	Value *begin = args++;
+	Value *end = args;
+
+	BasicBlock *entry = BasicBlock::Create(context, "entry", chunk);
+	Builder.SetInsertPoint(entry);
+	chunkEnv = Builder.CreateBitCast(chunkEnv, PointerType::getUnqual(envType), "env");
+	Value *chunkStart = Builder.CreateLoad(Builder.CreateStructGEP(chunkEnv, 0), "start");
+	Value *chunkStep = Builder.CreateLoad(Builder.CreateStructGEP(chunkEnv, 1), "step");
+	for (unsigned i = 0; i < captured.size(); ++i) {
+		AllocaInst *alloca = this->CreateEntryBlockAlloca(chunk, captured[i], fields[i + 2]);
+		Builder.CreateStore(Builder.CreateLoad(Builder.CreateStructGEP(chunkEnv, i + 2)), alloca);
+		NamedValues[captured[i]] = alloca;
+	}
+
+	AllocaInst *iter = this->CreateEntryBlockAlloca(chunk, iterName);
+	NamedValues[iterName] = iter;
+
+	// the value of no iterations
+	AllocaInst *acc = this->CreateEntryBlockAlloca(chunk, "acc");
+	double identity = reduce == MinReduction ? HUGE_VAL : reduce == MaxReduction ? -HUGE_VAL : 0.0;
+	Builder.CreateStore(ConstantFP::get(doubleTy, identity), acc);
+
+	BasicBlock *header = BasicBlock::Create(context, "loop", chunk);
+	BasicBlock *exit = BasicBlock::Create(context, "afterloop", chunk);
+	Builder.CreateCondBr(Builder.CreateICmpSLT(begin, end), header, exit);
+	Builder.SetInsertPoint(header);
+
+	PHINode *iv = Builder.CreatePHI(intTy, 2, iterName + ".iv");
+	iv->addIncoming(begin, entry);
+	Value *iterVal = Builder.CreateFAdd(chunkStart, Builder.CreateFMul(Builder.CreateSIToFP(iv, doubleTy), chunkStep));
+	Builder.CreateStore(iterVal, iter);
+
+	Value *bodyVal = this->Generate(expr->GetBody());
+	if (bodyVal && reduce != NoReduction)
+		bodyVal = this->Scalar(bodyVal, "Value of a reducing pfor body");
+
+	if (bodyVal) {
+		Value *accVal = Builder.CreateLoad(acc);
+		if (reduce == SumReduction)
+			Builder.CreateStore(Builder.CreateFAdd(accVal, bodyVal), acc);
+		else if (reduce != NoReduction) {
+			Value *better = reduce == MinReduction
+					? Builder.CreateFCmpOLT(bodyVal, accVal) : Builder.CreateFCmpOGT(bodyVal, accVal);
+			Builder.CreateStore(Builder.CreateSelect(better, bodyVal, accVal), acc);
+		}
+
+		BasicBlock *latch = BasicBlock::Create(context, "loopend", chunk);
+		Builder.CreateBr(latch);
+		Builder.SetInsertPoint(latch);
+
+		Value *next = Builder.CreateNSWAdd(iv, ConstantInt::get(intTy, 1), "nextvar");
+		iv->addIncoming(next, latch);
+		Builder.CreateCondBr(Builder.CreateICmpSLT(next, end), header, exit);
+
+		Builder.SetInsertPoint(exit);
+		this->FreeOwnedArrays();
+		Builder.CreateRet(Builder.CreateLoad(acc));
+		verifyFunction( *chunk);
+		TheFPM->run( *chunk);
+	}
+
+	CheckedCopies = checkedCopies;
+	CountedLoops.swap(countedLoops);
+	OwnedArrays.swap(ownedArrays);
+	Recursion = recursion;
+	NamedValues.swap(namedValues);
+	Builder.restoreIP(insertPoint);
+
+	if (bodyVal == 0) {
+		chunk->eraseFromParent();
+		return 0;
+	}
+
+	Value *envPtr = Builder.CreateBitCast(env, envPtrTy);
+
+	// lazily compiled code must not be entered from several threads at once
+	if (Lazy)
+		return Builder.CreateCall3(chunk, envPtr, ConstantInt::get(intTy, 0), count, "pfor");
+
+	Constant *pfor = TheModule->getOrInsertFunction("wtf_pfor", doubleTy, PointerType::getUnqual(chunkType),
+			envPtrTy, intTy, Type::getInt32Ty(context), NULL);
+	Value *pforArgs[4] = { chunk, envPtr, count, ConstantInt::get(Type::getInt32Ty(context), reduce) };
+	return Builder.CreateCall(pfor, pforArgs, "pfor");
+}
+
+Type *Codegen::GetArrayType() {
+	LLVMContext &context = TheModule->getContext();
+	return StructType::get(Type::getDoublePtrTy(context), Type::getInt64Ty(context), NULL);
+}
+
+AllocaInst *Codegen::LookupArray(StringRef name) {
+	map<string, AllocaInst*>::iterator it = NamedValues.find(name.str());
+	if (it == NamedValues.end() || !it->second || it->second->getAllocatedType() != this->GetArrayType())
+		return 0;
+	return it->second;
+}
+
+// 'var name = [size]' allocates a zeroed, 64 byte aligned array that lives
+// until the function returns or the declaration runs again
+Value *Codegen::GenerateArray(StringRef name, const ArrayExprAST *array) {
+	LLVMContext &context = TheModule->getContext();
+	Type *arrayType = this->GetArrayType();
+	Type *intTy = Type::getInt64Ty(context);
+	Function *func = Builder.GetInsertBlock()->getParent();
+
+	Value *size = this->Scalar(this->Generate(array->GetSize()), "Array size");
+	if (size == 0)
+		return 0;
+
+	// empty from the start, so returning frees it whichever way was taken
+	AllocaInst *alloca = this->CreateEntryBlockAlloca(func, name, arrayType);
+	BasicBlock &entry = func->getEntryBlock();
+	IRBuilder<> builder( &entry, entry.getTerminator() ? BasicBlock::iterator(entry.getTerminator()) : entry.end());
+	builder.CreateStore(Constant::getNullValue(arrayType), alloca);
+	OwnedArrays.push_back(alloca);
+
+	Constant *alloc = TheModule->getOrInsertFunction("wtf_alloc", Type::getDoublePtrTy(context), intTy, NULL);
+	Constant *release = TheModule->getOrInsertFunction("wtf_free", Type::getVoidTy(context),
+			Type::getDoublePtrTy(context), NULL);
+
+	// sizes without an i64 value are replaced before use, NaN and negative
+	// ones by -1 and huge ones by the largest i64, which wtf_alloc rejects
+	Type *doubleTy = Type::getDoubleTy(context);
+	Value *length = Builder.CreateFPToSI(size, intTy, "length");
+	Value *tooLarge = Builder.CreateFCmpOGE(size, ConstantFP::get(doubleTy, 9223372036854775808.0));
+	length = Builder.CreateSelect(tooLarge, ConstantInt::get(context, APInt::getSignedMaxValue(64)), length);
+	Value *valid = Builder.CreateFCmpOGE(size, ConstantFP::get(doubleTy, 0.0));
+	length = Builder.CreateSelect(valid, length, ConstantInt::get(intTy, -1), "length");
+	Builder.CreateCall(release, Builder.CreateExtractValue(Builder.CreateLoad(alloca), 0));
+	Value *data = Builder.CreateCall(alloc, length, "data");
+
+	Value *arrayVal = Builder.CreateInsertValue(UndefValue::get(arrayType), data, 0);
+	arrayVal = Builder.CreateInsertValue(arrayVal, length, 1);
+	Builder.CreateStore(arrayVal, alloca);
+
+	NamedValues[name.str()] = alloca;
+	return size;
+}
+
+void Codegen::FreeOwnedArrays() {
+	LLVMContext &context = TheModule->getContext();
+	Constant *release = TheModule->getOrInsertFunction("wtf_free", Type::getVoidTy(context),
+			Type::getDoublePtrTy(context), NULL);
+
+	for (unsigned i = 0; i < OwnedArrays.size(); ++i)
+		Builder.CreateCall(release, Builder.CreateExtractValue(Builder.CreateLoad(OwnedArrays[i]), 0));
+}
+
+Value *Codegen::Generate(const IndexExprAST *expr) {
+	Value *element = this->GenerateElementPointer(expr);
+	if (element == 0)
+		return 0;
+
+	return Builder.CreateLoad(element, expr->GetName());
+}
+
+// address of an element, checking the index first
+Value *Codegen::GenerateElementPointer(const IndexExprAST *expr) {
+	LLVMContext &context = TheModule->getContext();
+	Type *intTy = Type::getInt64Ty(context);
+
+	AllocaInst *alloca = this->LookupArray(expr->GetName());
+	if (alloca == 0)
+		return Diag.Throw<Value*>(str(boost::format("Unknown array '%1%'") % expr->GetName().str()));
+
+	Value *indexVal = this->Scalar(this->Generate(expr->GetIndex()), "Array index");
+	if (indexVal == 0)
+		return 0;
+
+	Value *array = Builder.CreateLoad(alloca, expr->GetName());
+	Value *data = Builder.CreateExtractValue(array, 0, "data");
+	Value *length = Builder.CreateExtractValue(array, 1, "length");
+
+	// no check when the enclosing loop tested the whole range up front
+	if (this->ProveInBounds(expr, alloca)) {
+		Value *index = Builder.CreateFPToSI(indexVal, intTy, "index");
+		return Builder.CreateGEP(data, index, "element");
+	}
+
+	// the double is checked before it is converted, NaN, infinite and huge
+	// indices have no integer value. Indices truncate toward zero, so
+	// everything above -1 and below the length is in bounds.
+	Type *doubleTy = Type::getDoubleTy(context);
+	Value *inBounds = Builder.CreateAnd(
+			Builder.CreateFCmpOGT(indexVal, ConstantFP::get(doubleTy, -1.0)),
+			Builder.CreateFCmpOLT(indexVal, Builder.CreateSIToFP(length, doubleTy)), "inbounds");
+
+	Function *func = Builder.GetInsertBlock()->getParent();
+	BasicBlock *failBlock = BasicBlock::Create(context, "outofbounds", func);
+	BasicBlock *okBlock = BasicBlock::Create(context, "inbounds", func);
+	Builder.CreateCondBr(inBounds, okBlock, failBlock);
+
+	Builder.SetInsertPoint(failBlock);
+	Constant *fail = TheModule->getOrInsertFunction("wtf_bounds_fail", Type::getVoidTy(context),
+			doubleTy, intTy, NULL);
+	if (Function *failFunc = dyn_cast<Function>(fail))
+		failFunc->setDoesNotReturn();
+
+	Value *failArgs[2] = { indexVal, length };
+	Builder.CreateCall(fail, failArgs);
+	Builder.CreateUnreachable();
+
+	Builder.SetInsertPoint(okBlock);
+	Value *index = Builder.CreateFPToSI(indexVal, intTy, "index");
+	return Builder.CreateGEP(data, index, "element");
+}
+
+// For 'array[iter]' and 'array[iter +- n]' inside a counted loop over iter,
+// a value computed in the loop's preheader telling whether every index the
+// loop produces is in bounds. 0 if that cannot be known up front. The copy
+// of the loop being generated only runs when it holds.
+Value *Codegen::ProveInBounds(const IndexExprAST *expr, AllocaInst *array) {
+	const ExprAST *index = expr->GetIndex();
+	int64_t offset = 0;
+
+	if (const BinaryExprAST *binary = dyn_cast<BinaryExprAST>(index)) {
+		if ((binary->GetOp() != '+' && binary->GetOp() != '-') || !IsSmallInteger(binary->GetRHS(), offset))
+			return 0;
+		if (binary->GetOp() == '-')
+			offset = -offset;
+		index = binary->GetLHS();
+	}
+
+	const VariableExprAST *iter = dyn_cast<VariableExprAST>(index);
+	if ( !iter)
+		return 0;
+
+	map<string, AllocaInst*>::iterator it = NamedValues.find(iter->GetName().str());
+	if (it == NamedValues.end())
+		return 0;
+
+	for (int i = CountedLoops.size() - 1; i >= 0; --i) {
+		CountedLoop &loop = *CountedLoops[i];
+		if (loop.Iter != it->second)
+			continue;
+
+		// the array has to stay the same while the loop runs
+		if (loop.First + offset < 0 || Assigns(loop.Body, expr->GetName()))
+			return 0;
+
+		Value *&inBounds = loop.InBounds[make_pair(array, offset)];
+		if ( !inBounds) {
+			IRBuilder<> builder(loop.Preheader->getTerminator());
+			Value *length = builder.CreateExtractValue(builder.CreateLoad(array), 1, "length");
+			Value *last = builder.CreateAdd(loop.Last, ConstantInt::get(length->getType(), offset));
+			inBounds = builder.CreateICmpSLT(last, length, "loopinbounds");
+		}
+		return inBounds;
+	}
+
+	return 0;
+}
+
+Type *Codegen::GetVectorType() {
+	return VectorType::get(Type::getDoubleTy(TheModule->getContext()), VectorWidth);
+}
+
+Value *Codegen::Splat(Value *scalar) {
+	Value *vec = Builder.CreateInsertElement(UndefValue::get(this->GetVectorType()), scalar, Builder.getInt32(0));
+	Constant *lanes = ConstantAggregateZero::get(VectorType::get(Builder.getInt32Ty(), VectorWidth));
+	return Builder.CreateShuffleVector(vec, UndefValue::get(this->GetVectorType()), lanes, "splat");
+}
+
+// val if it is a double, an error naming what it was for if it is a vec
+Value *Codegen::Scalar(Value *val, const string &what) {
+	if (val && val->getType()->isVectorTy())
+		return Diag.Throw<Value*>(what + " must be a double, not a vec");
+	return val;
+}
+
+Value *Codegen::GenerateVectorBuiltin(StringRef name, ArrayRef<ExprAST*> args) {
+	vector<Value*> vals;
+	for (unsigned i = 0; i < args.size(); ++i) {
+		vals.push_back(this->Generate(args[i]));
+		if (vals.back() == 0)
+			return 0;
+
+		// all but vec() take the vec first and doubles after it
+		bool wantVector = name != "vec" && i == 0;
+		if (vals.back()->getType()->isVectorTy() != wantVector)
+			return Diag.Throw<Value*>(str(boost::format("Argument %1% of %2% must be a %3%")
+					% (i + 1) % name.str() % (wantVector ? "vec" : "double")));
+	}
+
+	if (name == "vec") {
+		if (vals.size() == 1)
+			return this->Splat(vals[0]);
+
+		Value *vec = UndefValue::get(this->GetVectorType());
+		for (unsigned i = 0; i < VectorWidth; ++i)
+			vec = Builder.CreateInsertElement(vec, vals[i], Builder.getInt32(i), "vec");
+		return vec;
+	}
+
+	if (name == "lane" || name == "setlane") {
+		// lanes are numbered modulo the width, no index is out of range
+		Value *index = Builder.CreateFPToSI(vals[1], Builder.getInt32Ty(), "lane");
+		index = Builder.CreateAnd(index, Builder.getInt32(VectorWidth - 1));
+		if (name == "lane")
+			return Builder.CreateExtractElement(vals[0], index, "lane");
+		return Builder.CreateInsertElement(vals[0], vals[2], index, "setlane");
+	}
+
+	// lanes are combined from first to last, so sums round the same on
+	// every target
+	Value *result = Builder.CreateExtractElement(vals[0], Builder.getInt32(0));
+	for (unsigned i = 1; i < VectorWidth; ++i) {
+		Value *lane = Builder.CreateExtractElement(vals[0], Builder.getInt32(i));
+		if (name == "hsum") {
+			result = Builder.CreateFAdd(result, lane, "hsum");
+			continue;
+		}
+
+		Value *better = name == "hmin" ? Builder.CreateFCmpOLT(lane, result) : Builder.CreateFCmpOGT(lane, result);
+		result = Builder.CreateSelect(better, lane, result, name);
+	}
+	return result;
+}
+
+Value *Codegen::GenerateMathBuiltin(Intrinsic::ID id, StringRef name, ArrayRef<ExprAST*> args) {
+	vector<Value*> vals;
+	bool anyVector = false;
+	for (unsigned i = 0; i < args.size(); ++i) {
+		vals.push_back(this->Generate(args[i]));
+		if (vals.back() == 0)
+			return 0;
+		anyVector |= vals.back()->getType()->isVectorTy();
+	}
+
+	// doubles mixed with vecs are splatted, like operands of arithmetic
+	if (anyVector)
+		for (unsigned i = 0; i < vals.size(); ++i)
+			if ( !vals[i]->getType()->isVectorTy())
+				vals[i] = this->Splat(vals[i]);
+
+	Type *type = vals[0]->getType();
+	Function *func = Intrinsic::getDeclaration(TheModule, id, type);
+	Value *result = Builder.CreateCall(func, vals, name);
+
+	// llvm.sqrt is undefined below -0, libm and so the evaluator give NaN
+	if (id == Intrinsic::sqrt) {
+		Value *negative = Builder.CreateFCmpOLT(vals[0], Constant::getNullValue(type), "negative");
+		Value *nan = ConstantFP::get(type, numeric_limits<double>::quiet_NaN());
+		result = Builder.CreateSelect(negative, nan, result, name);
+	}
+	return result;
+}
+
+// print(a, b, c) prints its values on one line, with a single runtime call
+Value *Codegen::GeneratePrint(ArrayRef<ExprAST*> args) {
+	LLVMContext &context = TheModule->getContext();
+	Type *doubleTy = Type::getDoubleTy(context);
+
+	Value *values = ConstantPointerNull::get(Type::getDoublePtrTy(context));
+	if ( !args.empty()) {
+		Function *func = Builder.GetInsertBlock()->getParent();
+		ArrayType *type = ArrayType::get(doubleTy, args.size());
+		Value *array = this->CreateEntryBlockAlloca(func, "print", type);
+
+		for (unsigned i = 0; i < args.size(); ++i) {
+			Value *val = this->Scalar(this->Generate(args[i]), str(boost::format("Argument %1% of print") % (i + 1)));
+			if ( !val)
+				return 0;
+			Builder.CreateStore(val, Builder.CreateConstGEP2_32(array, 0, i));
+		}
+		values = Builder.CreateConstGEP2_32(array, 0, 0, "values");
+	}
+
+	Constant *print = TheModule->getOrInsertFunction("wtf_print", doubleTy, Type::getDoublePtrTy(context),
+			Type::getInt64Ty(context), NULL);
+	return Builder.CreateCall2(print, values, Builder.getInt64(args.size()), "print");
+}
+
 Function *Codegen::Generate(PrototypeAST *proto) {
-	string funcName = proto->GetName();
-	vector<string> args = proto->GetArgs();
+	StringRef funcName = proto->GetName();
+	ArrayRef<StringRef> args = proto->GetArgs();
+
+	LLVMContext &context = TheModule->getContext();
+	vector<Type*> params;
+	for (unsigned i = 0; i < args.size(); ++i) {
+		if (proto->IsArrayArg(i)) {
+			params.push_back(Type::getDoublePtrTy(context));
+			params.push_back(Type::getInt64Ty(context));
+		}
+		else
+			params.push_back(Type::getDoubleTy(context));
+	}
 
-	vector<Type*> Doubles(args.size(), Type::getDoubleTy(getGlobalContext()));
 	FunctionType *funcType = FunctionType::get(
-			Type::getDoubleTy(getGlobalContext()), Doubles, false);
+			Type::getDoubleTy(TheModule->getContext()), params, false);
 	Function* func = Function::Create(funcType, Function::ExternalLinkage,
 			funcName, TheModule);
 
@@ -328,58 +1349,493 @@ Function *Codegen::Generate(PrototypeAST *proto) {
 		func->eraseFromParent();
 		func = TheModule->getFunction(funcName);
 
-		if ( !func->empty()) {
-			BaseError::Throw<Function*>("Redefinition of function");
+		if ( !func->empty() || func->isMaterializable()) {
+			Diag.Throw<Function*>("Redefinition of function");
 			return 0;
 		}
 
-		if (func->arg_size() != args.size()) {
-			BaseError::Throw<Function*>("Redefinition of function with wrong number of arguments");
+		if (func->getFunctionType() != funcType) {
+			Diag.Throw<Function*>("Redefinition of function with different arguments");
 			return 0;
 		}
 	}
 
 	unsigned idx = 0;
 	for (Function::arg_iterator iterItem = func->arg_begin(); idx != args.size(); ++iterItem, ++idx) {
-		iterItem->setName(args[idx]);
+		if (proto->IsArrayArg(idx)) {
+			iterItem->setName(args[idx] + ".data");
+			++iterItem;
+			iterItem->setName(args[idx] + ".len");
+		}
+		else
+			iterItem->setName(args[idx]);
 	}
 
 	return func;
 }
 
 Function *Codegen::Generate(FunctionAST *funcAst) {
-	NamedValues.clear();
-
 	Function *func = this->Generate(funcAst->GetPrototype());
 	if (func == 0)
 		return 0;
 
-	BasicBlock *block = BasicBlock::Create(getGlobalContext(), "entry", func);
+	if ( !this->GenerateBody(func, funcAst->GetPrototype()->GetArgs(), funcAst->GetBody())) {
+		func->eraseFromParent();
+		return 0;
+	}
+
+	return func;
+}
+
+Function *Codegen::Generate(FunctionAST *funcAst, ASTArena *arena) {
+	Function *func = this->Generate(funcAst);
+
+	// the evaluator runs calls to it on the AST
+	PrototypeAST *proto = funcAst->GetPrototype();
+	if (func && Eval)
+		Eval->Define(proto->GetName(), proto->GetArgs(), funcAst->GetBody());
+	delete arena;
+
+	return func;
+}
+
+// emit and optimize the body of a declared function, on failure the
+// function is left as a declaration
+bool Codegen::GenerateBody(Function *func, ArrayRef<StringRef> args, BlockAST *body) {
+	NamedValues.clear();
+	OwnedArrays.clear();
+
+	BasicBlock *block = BasicBlock::Create(TheModule->getContext(), "entry", func);
 	Builder.SetInsertPoint(block);
 
-	this->CreateArgumentAllocas(funcAst->GetPrototype(), func);
+	this->CreateArgumentAllocas(args, func);
+
+	// the body starts after the allocas, so self recursive tail calls can
+	// jump back to it. Not when the body allocates arrays, the next round
+	// would free an array the call may have been passed.
+	Recursion.Func = AnyExpr(body, AllocatesArray()) ? 0 : func;
+	Recursion.Block = BasicBlock::Create(TheModule->getContext(), "tailrecurse", func);
+	Recursion.Args.clear();
+	for (unsigned i = 0; i < args.size(); ++i)
+		Recursion.Args.push_back(NamedValues[args[i].str()]);
+
+	Builder.CreateBr(Recursion.Block);
+	Builder.SetInsertPoint(Recursion.Block);
 
 	// iterate and codegen all expressions in body
-	Value *retVal = this->Generate(funcAst->GetBody());
+	Value *retVal = this->Scalar(this->Generate(body, true), "Return value of " + func->getName().str());
 
 	if (retVal) {
-		Builder.CreateRet(retVal);
+		if ( !Builder.GetInsertBlock()->getTerminator()) {
+			this->FreeOwnedArrays();
+			Builder.CreateRet(retVal);
+		}
 		verifyFunction( *func);
 		TheFPM->run( *func);
-		return func;
+		NewDefinitions.push_back(func);
+		return true;
 	}
 
-	func->eraseFromParent();
+	func->deleteBody();
+	return false;
+}
 
-	return 0;
+void Codegen::EnableLazyCompilation() {
+	Lazy = true;
+	TheModule->setMaterializer(new LazyBodyMaterializer(this));
+
+	// bodies are not generated from the AST it would be given
+	delete Eval;
+	Eval = 0;
+
+	// call not yet compiled functions through stubs, compiling on first call
+	if (ExecEngine)
+		ExecEngine->DisableLazyCompilation(false);
+}
+
+Function *Codegen::GenerateLazily(FunctionAST *funcAst, ASTArena *arena) {
+	Function *func = this->Generate(funcAst->GetPrototype());
+	return this->Defer(func, funcAst->GetPrototype()->GetArgs(), funcAst->GetBody(), arena);
+}
+
+Function *Codegen::GenerateLazily(OperatorAST *opr, ASTArena *arena) {
+	Function *func = this->GenerateOperatorPrototype(opr);
+	if (func)
+		this->RetainInlineOperator(opr);
+
+	return this->Defer(func, opr->GetArgs(), opr->GetBody(), arena);
+}
+
+Function *Codegen::Defer(Function *func, ArrayRef<StringRef> args, BlockAST *body, ASTArena *arena) {
+	if (func == 0) {
+		delete arena;
+		return 0;
+	}
+
+	PendingBody pending = { args, body, arena };
+	PendingBodies[func] = pending;
+	return func;
+}
+
+bool Codegen::IsPending(const Function *func) {
+	return PendingBodies.count(func);
+}
+
+bool Codegen::MaterializeBody(Function *func) {
+	map<const Function*, PendingBody>::iterator it = PendingBodies.find(func);
+	PendingBody pending = it->second;
+	PendingBodies.erase(it);
+
+	// the JIT may ask for a body while another one is being generated
+	IRBuilderBase::InsertPoint insertPoint = Builder.saveIP();
+	map<string, AllocaInst*> namedValues;
+	namedValues.swap(NamedValues);
+	TailRecursion recursion = Recursion;
+	vector<AllocaInst*> ownedArrays;
+	ownedArrays.swap(OwnedArrays);
+	vector<CountedLoop*> countedLoops;
+	countedLoops.swap(CountedLoops);
+	unsigned checkedCopies = CheckedCopies;
+	CheckedCopies = 0;
+
+	bool generated = this->GenerateBody(func, pending.Args, pending.Body);
+
+	CheckedCopies = checkedCopies;
+	CountedLoops.swap(countedLoops);
+	OwnedArrays.swap(ownedArrays);
+	Recursion = recursion;
+	NamedValues.swap(namedValues);
+	Builder.restoreIP(insertPoint);
+	delete pending.Arena;
+
+	return generated;
 }
 
-Value *Codegen::Generate(BlockAST *block) {
-	vector<ExprAST*> exprs = block->GetExpressions();
+Function *Codegen::GenerateTopLevel(ArrayRef<FunctionAST*> exprs) {
+	LLVMContext &context = TheModule->getContext();
+
+	FunctionType *funcType = FunctionType::get(Type::getDoubleTy(context), false);
+	Function *func = Function::Create(funcType, Function::ExternalLinkage, "", TheModule);
+
+	BasicBlock *current = BasicBlock::Create(context, "entry", func);
+	Builder.SetInsertPoint(current);
+	OwnedArrays.clear();
+
+	bool generated = false;
+	for (unsigned i = 0; i < exprs.size(); ++i) {
+		// every expression gets its own scope, as if run on its own
+		NamedValues.clear();
+
+		BasicBlock *block = BasicBlock::Create(context, "expr", func);
+		Builder.CreateBr(block);
+		Builder.SetInsertPoint(block);
+
+		if (this->Generate(exprs[i]->GetBody())) {
+			current = Builder.GetInsertBlock();
+			generated = true;
+			continue;
+		}
+
+		// drop whatever the failed expression emitted and go on after the
+		// last one that worked
+		current->getTerminator()->eraseFromParent();
+		vector<BasicBlock*> emitted;
+		for (Function::iterator it = block; it != func->end(); ++it) {
+			it->dropAllReferences();
+			emitted.push_back(it);
+		}
+		for (unsigned j = 0; j < emitted.size(); ++j)
+			emitted[j]->eraseFromParent();
+		Builder.SetInsertPoint(current);
+	}
+
+	if ( !generated) {
+		func->eraseFromParent();
+		return 0;
+	}
+
+	this->FreeOwnedArrays();
+	Builder.CreateRet(ConstantFP::get(context, APFloat(0.0)));
+	verifyFunction( *func);
+	TheFPM->run( *func);
+
+	return func;
+}
+
+void Codegen::AddTopLevelFunction(Function *func) {
+	func->setName("toplevel");
+	func->setLinkage(Function::InternalLinkage);
+	TopLevelFunctions.push_back(func);
+}
+
+Function *Codegen::GenerateMain() {
+	LLVMContext &context = TheModule->getContext();
+
+	if (TheModule->getFunction("main"))
+		return Diag.Throw<Function*>("'main' is reserved when compiling to a native program");
+
+	FunctionType *mainType = FunctionType::get(Type::getInt32Ty(context), false);
+	Function *main = Function::Create(mainType, Function::ExternalLinkage, "main", TheModule);
+
+	BasicBlock *block = BasicBlock::Create(context, "entry", main);
+	Builder.SetInsertPoint(block);
+
+	for (unsigned i = 0; i < TopLevelFunctions.size(); ++i)
+		Builder.CreateCall(TopLevelFunctions[i]);
+
+	// end the output with a newline, like the JIT driver does
+	Constant *pline = TheModule->getOrInsertFunction("pline", Type::getDoubleTy(context), NULL);
+	Builder.CreateCall(pline);
+
+	Builder.CreateRet(ConstantInt::get(Type::getInt32Ty(context), 0));
+	verifyFunction( *main);
+
+	return main;
+}
+
+Function *Codegen::GenerateInit(StringRef name) {
+	LLVMContext &context = TheModule->getContext();
+
+	if (TopLevelFunctions.empty())
+		return 0;
+
+	FunctionType *initType = FunctionType::get(Type::getDoubleTy(context), false);
+	Function *init = Function::Create(initType, Function::ExternalLinkage, name, TheModule);
+
+	BasicBlock *block = BasicBlock::Create(context, "entry", init);
+	Builder.SetInsertPoint(block);
+
+	for (unsigned i = 0; i < TopLevelFunctions.size(); ++i)
+		Builder.CreateCall(TopLevelFunctions[i]);
+	TopLevelFunctions.clear();
+
+	Builder.CreateRet(ConstantFP::get(context, APFloat(0.0)));
+	verifyFunction( *init);
+
+	return init;
+}
+
+Function *Codegen::GenerateBatch(Function *func) {
+	LLVMContext &context = TheModule->getContext();
+	Type *doubleTy = Type::getDoubleTy(context);
+	Type *doublePtrTy = Type::getDoublePtrTy(context);
+	Type *intTy = Type::getInt64Ty(context);
+	unsigned arity = func->arg_size();
+
+	string name = func->getName().str() + ".batch";
+	if (Function *batch = TheModule->getFunction(name))
+		return batch;
+
+	// the loop gets the output and input columns as parameters of their own,
+	// which do not overlap, so it can be vectorized without checking
+	vector<Type*> params(arity + 1, doublePtrTy);
+	params.push_back(intTy);
+	params.push_back(intTy);
+	FunctionType *loopType = FunctionType::get(Type::getVoidTy(context), params, false);
+	Function *loop = Function::Create(loopType, Function::InternalLinkage, name + ".loop", TheModule);
+	loop->addFnAttr(Attributes::NoInline);
+
+	vector<Value*> columns;
+	Function::arg_iterator args = loop->arg_begin();
+	for (unsigned i = 0; i <= arity; ++i, ++args) {
+		args->addAttr(Attributes::get(context, Attributes::NoAlias));
+		columns.push_back(args);
+	}
+	Value *begin = args++;
+	Value *end = args;
+
+	BasicBlock *entry = BasicBlock::Create(context, "entry", loop);
+	BasicBlock *header = BasicBlock::Create(context, "loop", loop);
+	BasicBlock *exit = BasicBlock::Create(context, "afterloop", loop);
+	Builder.SetInsertPoint(entry);
+	Builder.CreateCondBr(Builder.CreateICmpSLT(begin, end), header, exit);
+	Builder.SetInsertPoint(header);
+
+	PHINode *row = Builder.CreatePHI(intTy, 2, "row");
+	row->addIncoming(begin, entry);
+	vector<Value*> values;
+	for (unsigned i = 1; i <= arity; ++i)
+		values.push_back(Builder.CreateLoad(Builder.CreateGEP(columns[i], row)));
+	CallInst *call = Builder.CreateCall(func, values);
+	Builder.CreateStore(call, Builder.CreateGEP(columns[0], row));
+
+	Value *next = Builder.CreateNSWAdd(row, ConstantInt::get(intTy, 1), "nextrow");
+	row->addIncoming(next, header);
+	Builder.CreateCondBr(Builder.CreateICmpSLT(next, end), header, exit);
+	Builder.SetInsertPoint(exit);
+	Builder.CreateRetVoid();
+
+	// externs stay calls
+	func->Materialize();
+	InlineFunctionInfo inlineInfo;
+	InlineFunction(call, inlineInfo);
+	verifyFunction( *loop);
+	if (TheBatchFPM)
+		TheBatchFPM->run( *loop);
+
+	// unpacks the columns for the loop
+	Type *chunkParams[3] = { Type::getInt8PtrTy(context), intTy, intTy };
+	FunctionType *batchType = FunctionType::get(doubleTy, chunkParams, false);
+	Function *batch = Function::Create(batchType, Function::ExternalLinkage, name, TheModule);
+
+	args = batch->arg_begin();
+	Value *env = args++;
+	begin = args++;
+	end = args;
+
+	Builder.SetInsertPoint(BasicBlock::Create(context, "entry", batch));
+	env = Builder.CreateBitCast(env, PointerType::getUnqual(doublePtrTy), "columns");
+	vector<Value*> loopArgs;
+	for (unsigned i = 0; i <= arity; ++i)
+		loopArgs.push_back(Builder.CreateLoad(Builder.CreateConstGEP1_32(env, i)));
+	loopArgs.push_back(begin);
+	loopArgs.push_back(end);
+	Builder.CreateCall(loop, loopArgs);
+	Builder.CreateRet(ConstantFP::get(doubleTy, 0.0));
+	verifyFunction( *batch);
+
+	return batch;
+}
+
+bool Codegen::EmitObjectFile(TargetMachine *target, string fileName, string &errStr) {
+	tool_output_file out(fileName.c_str(), errStr, raw_fd_ostream::F_Binary);
+	if ( !errStr.empty())
+		return false;
+
+	PassManager PM;
+	PM.add(new DataLayout( *target->getDataLayout()));
+
+	{
+		formatted_raw_ostream fout(out.os());
+		if (target->addPassesToEmitFile(PM, fout, TargetMachine::CGFT_ObjectFile)) {
+			errStr = "target does not support object file emission";
+			return false;
+		}
+
+		PM.run( *TheModule);
+	}
+
+	// keep the file, tool_output_file removes it otherwise
+	out.keep();
+	return true;
+}
+
+void Codegen::RunModulePasses(bool wholeProgram) {
+	vector<WeakVH> added;
+	added.swap(NewDefinitions);
+
+	// bodies of lazily compiled functions are not there to work with yet
+	if ( !TheMPM || Lazy)
+		return;
+
+	if (wholeProgram) {
+		for (Module::iterator it = TheModule->begin(); it != TheModule->end(); ++it)
+			if ( !it->isDeclaration() && it->getName() != "main")
+				it->setLinkage(Function::InternalLinkage);
+
+		TheMPM->run( *TheModule);
+		return;
+	}
+
+	// the new definitions and the functions they use, which the inliner
+	// may want to see
+	set<Function*> visible;
+	for (unsigned i = 0; i < added.size(); ++i) {
+		Function *func = cast_or_null<Function>((Value*) added[i]);
+		if ( !func || func->isDeclaration())
+			continue;
+		visible.insert(func);
+		for (inst_iterator inst = inst_begin(func); inst != inst_end(func); ++inst)
+			for (unsigned op = 0; op < inst->getNumOperands(); ++op)
+				if (Function *used = dyn_cast<Function>(inst->getOperand(op)))
+					visible.insert(used);
+	}
+	if (visible.empty())
+		return;
+
+	// Definitions optimized by earlier runs are parked in functions outside
+	// the module while the passes run, so a run costs what was added rather
+	// than the whole module. A global refers to them meanwhile, so no pass
+	// takes the declarations they leave behind for unused ones.
+	LLVMContext &context = TheModule->getContext();
+	Type *ptrTy = Type::getInt8PtrTy(context);
+	vector<pair<Function*, Function*> > parked;
+	vector<Constant*> refs;
+	for (Module::iterator it = TheModule->begin(); it != TheModule->end(); ++it) {
+		if (it->isDeclaration() || visible.count(it))
+			continue;
+		Function *holder = Function::Create(it->getFunctionType(), Function::ExternalLinkage);
+		holder->getBasicBlockList().splice(holder->end(), it->getBasicBlockList());
+		parked.push_back(make_pair((Function*) it, holder));
+		refs.push_back(ConstantExpr::getBitCast(it, ptrTy));
+	}
+
+	GlobalVariable *refsVar = 0;
+	if ( !refs.empty()) {
+		ArrayType *refsTy = ArrayType::get(ptrTy, refs.size());
+		refsVar = new GlobalVariable( *TheModule, refsTy, true, GlobalValue::ExternalLinkage,
+				ConstantArray::get(refsTy, refs), "wtf.parked");
+	}
+
+	TheMPM->run( *TheModule);
+
+	if (refsVar)
+		refsVar->eraseFromParent();
+	for (unsigned i = 0; i < parked.size(); ++i) {
+		Function *func = parked[i].first;
+		func->getBasicBlockList().splice(func->end(), parked[i].second->getBasicBlockList());
+		delete parked[i].second;
+	}
+}
+
+Module *Codegen::CloneDefinitions(const set<string> &names) {
+	// lazily compiled definitions need their bodies now
+	for (set<string>::const_iterator it = names.begin(); it != names.end(); ++it)
+		if (Function *func = TheModule->getFunction( *it))
+			func->Materialize();
+
+	Module *clone = CloneModule(TheModule);
+
+	// strip the bodies of everything that was not asked for
+	for (Module::iterator it = clone->begin(); it != clone->end(); ++it)
+		if ( !names.count(it->getName().str()) && !it->isDeclaration())
+			it->deleteBody();
+
+	// and drop the declarations nothing refers to anymore
+	for (Module::iterator it = clone->begin(); it != clone->end(); ) {
+		Function *func = it++;
+		if ( !names.count(func->getName().str()) && func->use_empty())
+			func->eraseFromParent();
+	}
+
+	return clone;
+}
+
+bool Codegen::LinkModule(Module *module) {
+	vector<string> defined;
+	for (Module::iterator it = module->begin(); it != module->end(); ++it)
+		if ( !it->isDeclaration())
+			defined.push_back(it->getName().str());
+
+	string errStr;
+	bool failed = Linker::LinkModules(TheModule, module, Linker::DestroySource, &errStr);
+	delete module;
+
+	if (failed)
+		return Diag.Throw<bool>(str(boost::format("Could not link module: %1%") % errStr));
+
+	for (unsigned i = 0; i < defined.size(); ++i)
+		if (Function *func = TheModule->getFunction(defined[i]))
+			NewDefinitions.push_back(func);
+	return true;
+}
+
+Value *Codegen::Generate(const BlockAST *block, bool tail) {
+	ArrayRef<ExprAST*> exprs = block->GetExpressions();
 	int size = exprs.size();
 	for (int i = 0; i < size; ++i) {
 		ExprAST *curr = exprs[i];
-		Value *val = this->Generate(curr);
+		Value *val = this->Generate(curr, tail && i == size - 1);
 
 		// create return value if last expression
 		if (i == size - 1)
@@ -389,40 +1845,224 @@ Value *Codegen::Generate(BlockAST *block) {
 	return 0;
 }
 
-Value *Codegen::Generate(UnaryExprAST *expr) {
+Value *Codegen::Generate(const UnaryExprAST *expr) {
 	ExprAST *code = expr->GetOperand();
 	Value *val = this->Generate(code);
 	if ( !val)
 		return 0;
 
-	Function *func = TheModule->getFunction("unary" + expr->GetOp());
+	InlineOperator &inlineOp = InlineUnaryOps[(unsigned char) expr->GetOp()];
+	if (inlineOp.Body && !inlineOp.Active)
+		return this->GenerateInline(inlineOp, val);
+
+	Function *func = this->GetOperatorFunction(false, expr->GetOp());
 	if (func == 0)
-		return BaseError::Throw<Value*>(str(boost::format("Unknown unary operator '%1%'") % expr->GetOp()));
+		return Diag.Throw<Value*>(str(boost::format("Unknown unary operator '%1%'") % expr->GetOp()));
+	if ( !this->Scalar(val, str(boost::format("Operand of '%1%'") % expr->GetOp())))
+		return 0;
 
 	return Builder.CreateCall(func, val, "unaryop");
 }
 
-Function *Codegen::Generate(OperatorAST *opr) {
-	NamedValues.clear();
+Function *Codegen::GetOperatorFunction(bool binary, char op) {
+	Function *&func = (binary ? BinaryOps : UnaryOps)[(unsigned char) op];
+
+	// operators linked in from cached imports are found by name
+	if ( !func)
+		func = TheModule->getFunction(string(binary ? "binary" : "unary") + op);
+
+	return func;
+}
+
+// evaluate the operator's body with its arguments bound to the operands,
+// in a scope of their own as if it had been called
+Value *Codegen::GenerateInline(InlineOperator &opr, ArrayRef<Value*> operands) {
+	Function *func = Builder.GetInsertBlock()->getParent();
 
-	string opName = (opr->IsBinary() ? "binary" : "unary") + opr->GetOp();
-	vector<string> args = opr->GetArgs();
+	map<string, AllocaInst*> namedValues;
+	namedValues.swap(NamedValues);
 
-	vector<Type*> Doubles(args.size(), Type::getDoubleTy(getGlobalContext()));
-	FunctionType *funcType = FunctionType::get(Type::getDoubleTy(getGlobalContext()), Doubles, false);
+	for (unsigned i = 0; i < operands.size(); ++i) {
+		AllocaInst *alloca = this->CreateEntryBlockAlloca(func, opr.Args[i], operands[i]->getType());
+		Builder.CreateStore(operands[i], alloca);
+		NamedValues[opr.Args[i].str()] = alloca;
+	}
+
+	opr.Active = true;
+	Value *val = this->Generate(opr.Body);
+	opr.Active = false;
+
+	NamedValues.swap(namedValues);
+	return val;
+}
+
+Function *Codegen::Generate(OperatorAST *opr, ASTArena *arena) {
+	Function *func = this->GenerateOperatorPrototype(opr);
+	if (func == 0) {
+		delete arena;
+		return 0;
+	}
+
+	if ( !this->GenerateBody(func, opr->GetArgs(), opr->GetBody())) {
+		(opr->IsBinary() ? BinaryOps : UnaryOps)[(unsigned char) opr->GetOp()] = 0;
+		func->eraseFromParent();
+		delete arena;
+		return 0;
+	}
+
+	if ( !this->RetainInlineOperator(opr) && Eval)
+		Eval->Define(func->getName(), opr->GetArgs(), opr->GetBody());
+	delete arena;
+
+	return func;
+}
+
+// keep a copy of the AST of operators simple enough to substitute, returns
+// whether opr is one. Copies of redefined operators stay in InlineArena,
+// they are only as large as the operator's source.
+bool Codegen::RetainInlineOperator(OperatorAST *opr) {
+	ArrayRef<ExprAST*> exprs = opr->GetBody()->GetExpressions();
+	if (exprs.size() != 1 || opr->GetArgs().size() != (opr->IsBinary() ? 2 : 1))
+		return false;
+
+	CopyExpr copy(InlineArena);
+	InlineOperator inlineOp = { copy.Copy(opr->GetArgs()), copy.Copy(exprs[0]), false };
+	(opr->IsBinary() ? InlineBinaryOps : InlineUnaryOps)[(unsigned char) opr->GetOp()] = inlineOp;
+
+	if (Eval) {
+		string opName = string(opr->IsBinary() ? "binary" : "unary") + opr->GetOp();
+		Eval->Define(opName, opr->GetArgs(), opr->GetBody());
+	}
+	return true;
+}
+
+// writes expressions as text naming every node and its children, so equal
+// text means equal expressions
+class DescribeExpr : public ExprVisitor<DescribeExpr, void> {
+	string &Out;
+
+public:
+	DescribeExpr(string &out)
+			: Out(out) {
+	}
+
+	void Describe(const ExprAST *expr) {
+		if (expr)
+			this->Dispatch( *expr);
+		else
+			Out += " _";
+	}
+
+	void Describe(const BlockAST *block) {
+		if ( !block) {
+			Out += " _";
+			return;
+		}
+		Out += " {";
+		ArrayRef<ExprAST*> exprs = block->GetExpressions();
+		for (unsigned i = 0; i < exprs.size(); ++i)
+			this->Describe(exprs[i]);
+		Out += " }";
+	}
+
+	void Visit(const NumberExprAST &expr) {
+		Out += str(boost::format(" %.17g") % expr.GetVal());
+	}
+	void Visit(const VariableExprAST &expr) {
+		Out += " $" + expr.GetName().str();
+	}
+	void Visit(const BinaryExprAST &expr) {
+		Out += str(boost::format(" (binary %1%") % (int) (unsigned char) expr.GetOp());
+		this->Describe(expr.GetLHS());
+		this->Describe(expr.GetRHS());
+		Out += ")";
+	}
+	void Visit(const UnaryExprAST &expr) {
+		Out += str(boost::format(" (unary %1%") % (int) (unsigned char) expr.GetOp());
+		this->Describe(expr.GetOperand());
+		Out += ")";
+	}
+	void Visit(const CallExprAST &expr) {
+		Out += " (call " + expr.GetCallee().str();
+		ArrayRef<ExprAST*> args = expr.GetArgs();
+		for (unsigned i = 0; i < args.size(); ++i)
+			this->Describe(args[i]);
+		Out += ")";
+	}
+	void Visit(const ConditionalExprAST &expr) {
+		Out += " (if";
+		ArrayRef<ConditionalElement> conds = expr.GetConds();
+		for (unsigned i = 0; i < conds.size(); ++i) {
+			this->Describe(conds[i].GetCond());
+			this->Describe(conds[i].GetConsequence());
+		}
+		this->Describe(expr.GetElse());
+		Out += ")";
+	}
+	void Visit(const ForExprAST &expr) {
+		Out += str(boost::format(" (for %1% %2% %3%") % expr.GetIterName().str() % expr.IsParallel()
+				% expr.GetReduction());
+		this->Describe(expr.GetInit());
+		this->Describe(expr.GetStep());
+		this->Describe(expr.GetEnd());
+		this->Describe(expr.GetBody());
+		Out += ")";
+	}
+	void Visit(const VarExprAST &expr) {
+		Out += " (var " + expr.GetName().str();
+		this->Describe(expr.GetInitialValue());
+		Out += ")";
+	}
+	void Visit(const ArrayExprAST &expr) {
+		Out += " (array";
+		this->Describe(expr.GetSize());
+		Out += ")";
+	}
+	void Visit(const IndexExprAST &expr) {
+		Out += " (index " + expr.GetName().str();
+		this->Describe(expr.GetIndex());
+		Out += ")";
+	}
+};
+
+string Codegen::DescribeInlineOperators() {
+	string out;
+	DescribeExpr describe(out);
+	for (int binary = 0; binary < 2; ++binary)
+		for (int op = 0; op < 256; ++op) {
+			InlineOperator &inlineOp = (binary ? InlineBinaryOps : InlineUnaryOps)[op];
+			if ( !inlineOp.Body)
+				continue;
+
+			out += str(boost::format("%1% %2% (") % (binary ? "binary" : "unary") % op);
+			for (unsigned i = 0; i < inlineOp.Args.size(); ++i)
+				out += " " + inlineOp.Args[i].str();
+			out += ")";
+			describe.Describe(inlineOp.Body);
+			out += "\n";
+		}
+	return out;
+}
+
+Function *Codegen::GenerateOperatorPrototype(OperatorAST *opr) {
+	string opName = string(opr->IsBinary() ? "binary" : "unary") + opr->GetOp();
+	ArrayRef<StringRef> args = opr->GetArgs();
+
+	vector<Type*> Doubles(args.size(), Type::getDoubleTy(TheModule->getContext()));
+	FunctionType *funcType = FunctionType::get(Type::getDoubleTy(TheModule->getContext()), Doubles, false);
 	Function* func = Function::Create(funcType, Function::ExternalLinkage, opName, TheModule);
 
 	if (func->getName() != opName) {
 		func->eraseFromParent();
 		func = TheModule->getFunction(opName);
 
-		if ( !func->empty()) {
-			BaseError::Throw<Function*>("Redefinition of operator");
+		if ( !func->empty() || func->isMaterializable()) {
+			Diag.Throw<Function*>("Redefinition of operator");
 			return 0;
 		}
 
 		if (func->arg_size() != args.size()) {
-			BaseError::Throw<Function*>("Redefinition of operator with wrong number of arguments");
+			Diag.Throw<Function*>("Redefinition of operator with wrong number of arguments");
 			return 0;
 		}
 	}
@@ -432,38 +2072,32 @@ Function *Codegen::Generate(OperatorAST *opr) {
 		AI->setName(args[Idx]);
 	}
 
-	// add the body
-	BasicBlock *block = BasicBlock::Create(getGlobalContext(), "opfunc", func);
-	Builder.SetInsertPoint(block);
-
-	this->CreateArgumentAllocas(args, func);
-
-	Value *retVal = this->Generate(opr->GetBody());
-	if (retVal) {
-		Builder.CreateRet(retVal);
-		verifyFunction( *func);
-		TheFPM->run( *func);
-		return func;
-	}
+	// operators are small, calls that are left get inlined by the module passes
+	func->addFnAttr(Attributes::AlwaysInline);
+	(opr->IsBinary() ? BinaryOps : UnaryOps)[(unsigned char) opr->GetOp()] = func;
 
-	func->eraseFromParent();
-	return 0;
+	return func;
 }
 
-Value *Codegen::Generate(VarExprAST *varAst) {
+Value *Codegen::Generate(const VarExprAST *varAst) {
+	if (ArrayExprAST *array = dyn_cast_or_null<ArrayExprAST>(varAst->GetInitialValue()))
+		return this->GenerateArray(varAst->GetName(), array);
 
-	BasicBlock *currentEntry = Builder.GetInsertBlock();
-
-	// allocate the variable
-	AllocaInst *alloca = this->CreateEntryBlockAlloca(currentEntry, varAst->GetName());
+	Function *func = Builder.GetInsertBlock()->getParent();
 
 	Value *initVal = this->Generate(varAst->GetInitialValue());
+	if (initVal == 0)
+		return 0;
+
+	// allocate the variable up front, the body may be a loop. It keeps the
+	// type of its initial value, a double or a vec.
+	AllocaInst *alloca = this->CreateEntryBlockAlloca(func, varAst->GetName(), initVal->getType());
 
 	// store the initial value
 	Builder.CreateStore(initVal, alloca);
 
 	// save the variable in the symbol table
-	NamedValues[varAst->GetName()] = alloca;
+	NamedValues[varAst->GetName().str()] = alloca;
 
 	return alloca;
 }
@@ -1,6 +1,7 @@
 #include "llvm/Module.h"
 #include "llvm/PassManager.h"
 #include "llvm/IRBuilder.h"
+#include "llvm/Intrinsics.h"
 #include "llvm/Analysis/Verifier.h"
 #include "llvm/LLVMContext.h"
 #include "llvm/Support/TargetSelect.h"
@@ -10,11 +11,27 @@
 #include "llvm/DerivedTypes.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/DataLayout.h"
+#include "llvm/Linker.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/GVMaterializer.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Support/ValueHandle.h"
 
 #include "boost/format.hpp"
 
+#include <set>
+#include <cmath>
+
 #include "AST.hpp"
+#include "ASTArena.hpp"
 #include "Errors.hpp"
+#include "CompilerSession.hpp"
+#include "Evaluator.hpp"
 
 #ifndef CODEGEN_HPP
 #define CODEGEN_HPP
@@ -22,14 +39,95 @@
 using namespace llvm;
 
 class Codegen {
+	Diagnostics &Diag;
 	map<string, AllocaInst*> NamedValues;
 	IRBuilder<> Builder;
 	Module *TheModule;
 	FunctionPassManager *TheFPM;
+	// interprocedural passes, 0 at -O0
+	PassManager *TheMPM;
+	// vectorizes the loops of GenerateBatch, 0 at -O0
+	FunctionPassManager *TheBatchFPM;
+	unsigned OptLevel;
+	// definitions added since the module passes last ran, null once erased
+	vector<WeakVH> NewDefinitions;
 	ExecutionEngine *ExecEngine;
+	// top level expressions, in source order, when compiling ahead of time
+	vector<Function*> TopLevelFunctions;
+
+	// bodies of lazily compiled functions not called yet
+	struct PendingBody {
+		ArrayRef<StringRef> Args;
+		BlockAST *Body;
+		ASTArena *Arena;
+	};
+	map<const Function*, PendingBody> PendingBodies;
+	bool Lazy;
+
+	// operator functions by operator character, filled on first use
+	Function *BinaryOps[256];
+	Function *UnaryOps[256];
+
+	// operators whose body is a single expression, generated in place of
+	// a call with their arguments bound to the evaluated operands
+	struct InlineOperator {
+		ArrayRef<StringRef> Args;
+		ExprAST *Body;
+		// set while the body is being substituted, recursive uses are calls
+		bool Active;
+	};
+	InlineOperator InlineBinaryOps[256];
+	InlineOperator InlineUnaryOps[256];
+	// copies of the argument names and bodies of inline operators, the
+	// arenas they were read in are freed as usual
+	ASTArena InlineArena;
+
+	// runs top level expressions on the AST of the definitions it is given,
+	// 0 unless the JIT compiles whole definitions as they are read
+	Evaluator *Eval;
+
+	// where self recursive calls in tail position of the function being
+	// generated jump to, after storing their arguments
+	struct TailRecursion {
+		Function *Func;
+		BasicBlock *Block;
+		vector<AllocaInst*> Args;
+	};
+	TailRecursion Recursion;
+
+	// arrays allocated by the function being generated, freed on return
+	vector<AllocaInst*> OwnedArrays;
+
+	// counted loops around the code being generated, innermost last
+	struct CountedLoop {
+		AllocaInst *Iter;
+		const BlockAST *Body;
+		BasicBlock *Preheader;
+		int64_t First;
+		Value *Last;
+		// per array and index offset, whether every index the loop
+		// produces is in bounds, computed in the preheader. The copy of
+		// the body being generated runs only when all of them hold.
+		map<pair<AllocaInst*, int64_t>, Value*> InBounds;
+	};
+	vector<CountedLoop*> CountedLoops;
+	// checked copies of counted loops being generated, loops inside them
+	// are generated plainly
+	unsigned CheckedCopies;
 
 public:
-	Codegen(ExecutionEngine *execEngine, Module *module);
+	// lanes of a vec, four doubles fill an AVX register
+	enum { VectorWidth = 4 };
+
+	// generate code for the JIT, module belongs to session's context
+	Codegen(CompilerSession &session, ExecutionEngine *execEngine, Module *module, unsigned optLevel = 1);
+	// generate code for a native object file, or a module linked into
+	// another one later
+	Codegen(CompilerSession &session, const DataLayout *layout, Module *module, unsigned optLevel = 1);
+	~Codegen();
+
+	// the backend's optimization level for -O<optLevel>
+	static CodeGenOpt::Level CodeGenLevel(unsigned optLevel);
 
 	Module *GetModule() {
 		return this->TheModule;
@@ -37,28 +135,109 @@ public:
 	ExecutionEngine *GetExecEngine() {
 		return this->ExecEngine;
 	}
+	// 0 when compiling ahead of time or lazily
+	Evaluator *GetEvaluator() {
+		return this->Eval;
+	}
+
+	// tail is set for expressions whose value the function returns
+	Value *Generate(const ExprAST *expr, bool tail = false);
+	Value *Generate(const NumberExprAST *expr);
+	Value *Generate(const VariableExprAST *expr);
+	Value *Generate(const BinaryExprAST *expr);
+	Value *Generate(const UnaryExprAST *expr);
+	Value *Generate(const CallExprAST *expr, bool tail = false);
+	Value *Generate(const ConditionalExprAST *expr, bool tail = false);
+	Value *Generate(const ForExprAST *expr);
+	Value *Generate(const BlockAST *block, bool tail = false);
+	Value *Generate(const VarExprAST *varAst);
+	Value *Generate(const IndexExprAST *expr);
 
-	Value *Generate(ExprAST *expr);
-	Value *Generate(NumberExprAST *expr);
-	Value *Generate(VariableExprAST *expr);
-	Value *Generate(BinaryExprAST *expr);
-	Value *Generate(UnaryExprAST *expr);
-	Value *Generate(CallExprAST *expr);
-	Value *Generate(ConditionalExprAST *expr);
-	Value *Generate(ForExprAST *expr);
-	Value *Generate(BlockAST *block);
-	Value *Generate(VarExprAST *varAst);
-
-	Function *Generate(OperatorAST *expr);
+	// takes over arena, which owns the operator's AST
+	Function *Generate(OperatorAST *opr, ASTArena *arena);
 	Function *Generate(PrototypeAST *proto);
 	Function *Generate(FunctionAST *func);
+	// takes over arena, which owns the function's AST
+	Function *Generate(FunctionAST *func, ASTArena *arena);
+
+	// generate function bodies only when the JIT first needs them
+	void EnableLazyCompilation();
+	bool IsLazy() {
+		return this->Lazy;
+	}
+	// declare the function now and keep arena, which owns its AST, until
+	// the body is generated
+	Function *GenerateLazily(FunctionAST *func, ASTArena *arena);
+	Function *GenerateLazily(OperatorAST *opr, ASTArena *arena);
+	bool IsPending(const Function *func);
+	bool MaterializeBody(Function *func);
+
+	// one function running the given top level expressions in order,
+	// expressions failing to generate are left out
+	Function *GenerateTopLevel(ArrayRef<FunctionAST*> exprs);
+	// queue a generated top level expression to be run from main
+	void AddTopLevelFunction(Function *func);
+	// create main, calling all queued top level expressions in order
+	Function *GenerateMain();
+	// the same as a function of the given name returning a double, for
+	// modules linked into a program, 0 if nothing is queued
+	Function *GenerateInit(StringRef name);
+	// double <func>.batch(i8 *env, i64 begin, i64 end), storing func of row
+	// i of the columns env points to in row i of the column before them, for
+	// rows [begin, end). func takes only doubles and is inlined into a loop
+	// vectorized where possible. Takes chunks of rows from wtf_pfor.
+	Function *GenerateBatch(Function *func);
+	bool EmitObjectFile(TargetMachine *target, string fileName, string &errStr);
+
+	// optimize the definitions added since the last run together with the
+	// functions they use, wholeProgram optimizes all of them and hides
+	// everything but main from other modules so unused definitions can go
+	void RunModulePasses(bool wholeProgram = false);
+
+	// the operators expanded in place of calls, as text equal for equal
+	// operators, for the module cache
+	string DescribeInlineOperators();
+
+	// copy of the module holding only the named definitions, used functions
+	// defined elsewhere are kept as declarations
+	Module *CloneDefinitions(const set<string> &names);
+	// link a module into this one, taking ownership of it
+	bool LinkModule(Module *module);
+
+	// a double slot unless another type is given
+	AllocaInst *CreateEntryBlockAlloca(Function *func, StringRef varName, Type *type = 0);
+
+	void CreateArgumentAllocas(ArrayRef<StringRef> args, Function *func);
 
+private:
+	void InitializePasses(const DataLayout *layout, unsigned optLevel);
+	void InitializeOperators();
+	Function *GenerateOperatorPrototype(OperatorAST *opr);
+	bool RetainInlineOperator(OperatorAST *opr);
+	Value *GenerateLoop(const ForExprAST *expr);
+	Value *GenerateCountedLoop(const ForExprAST *expr, int64_t init, int64_t step, const ExprAST *bound);
+	Value *GenerateParallelLoop(const ForExprAST *expr);
 
-	AllocaInst *CreateEntryBlockAlloca(Function *func, string varName);
-	AllocaInst *CreateEntryBlockAlloca(BasicBlock *block, string varName);
+	// arrays are held as { double *data, i64 length }
+	Type *GetArrayType();
+	AllocaInst *LookupArray(StringRef name);
+	Value *GenerateArray(StringRef name, const ArrayExprAST *array);
+	Value *GenerateElementPointer(const IndexExprAST *expr);
+	Value *ProveInBounds(const IndexExprAST *expr, AllocaInst *array);
+	void FreeOwnedArrays();
 
-	void CreateArgumentAllocas(PrototypeAST *proto, Function *func);
-	void CreateArgumentAllocas(vector<string> args, Function *func);
+	// vecs are <VectorWidth x double>, only arithmetic and the builtins
+	// take them, everything else wants scalars
+	Type *GetVectorType();
+	Value *Splat(Value *scalar);
+	Value *Scalar(Value *val, const string &what);
+	Value *GenerateVectorBuiltin(StringRef name, ArrayRef<ExprAST*> args);
+	Value *GenerateMathBuiltin(Intrinsic::ID id, StringRef name, ArrayRef<ExprAST*> args);
+	Value *GeneratePrint(ArrayRef<ExprAST*> args);
+	Function *GetOperatorFunction(bool binary, char op);
+	Value *GenerateInline(InlineOperator &opr, ArrayRef<Value*> operands);
+	bool GenerateBody(Function *func, ArrayRef<StringRef> args, BlockAST *body);
+	Function *Defer(Function *func, ArrayRef<StringRef> args, BlockAST *body, ASTArena *arena);
 };
 
 #endif
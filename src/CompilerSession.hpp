@@ -0,0 +1,58 @@
+#include "llvm/LLVMContext.h"
+#include "llvm/Support/Threading.h"
+
+#include <cstdio>
+#include <map>
+#include <mutex>
+
+#include "Errors.hpp"
+#include "ImportRegistry.hpp"
+
+#ifndef COMPILERSESSION_HPP
+#define COMPILERSESSION_HPP
+
+using namespace std;
+using namespace llvm;
+
+// The state one compilation shares between its parsers, code generators and
+// imports: the LLVM context its modules live in, the operator precedences,
+// the files imported so far and where errors go. Sessions share nothing,
+// each can compile on a thread of its own.
+class CompilerSession {
+	LLVMContext Context;
+	map<char, int> Precedence;
+	ImportRegistry Imports;
+	Diagnostics Diag;
+
+	CompilerSession(const CompilerSession&);
+	CompilerSession &operator=(const CompilerSession&);
+
+	// LLVM only locks its process wide state, like the lazily created
+	// statics behind the pass registry, once it is told threads are coming.
+	// Done by the first session, so every later one may be on a thread.
+	static void StartMultithreaded() {
+		static once_flag started;
+		call_once(started, llvm_start_multithreaded);
+	}
+
+public:
+	CompilerSession(FILE *errors = stderr)
+			: Diag(errors) {
+		StartMultithreaded();
+	}
+
+	LLVMContext &GetContext() {
+		return this->Context;
+	}
+	map<char, int> &GetPrecedence() {
+		return this->Precedence;
+	}
+	ImportRegistry &GetImports() {
+		return this->Imports;
+	}
+	Diagnostics &GetDiagnostics() {
+		return this->Diag;
+	}
+};
+
+#endif
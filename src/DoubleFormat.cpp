@@ -0,0 +1,264 @@
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+#include "DoubleFormat.hpp"
+#include "Pow5Tables.hpp"
+
+using namespace std;
+
+// Shortest digits by Ryu (Ulf Adams, PLDI 2018): the bounds of the interval
+// of decimals rounding to a double are scaled by a power of ten with 128 bit
+// multipliers from Pow5Tables.hpp, then digits are dropped from all three
+// until the bounds meet. No bignums, no loop over precisions.
+
+enum {
+	MantissaBits = 52,
+	ExponentBits = 11,
+	ExponentBias = 1023,
+	Pow5InvBits = 125,
+	Pow5Bits = 125
+};
+
+typedef unsigned __int128 uint128_t;
+
+// bits of 5^e, for e up to 3528
+static int Pow5BitCount(int e) {
+	return ((e * 1217359) >> 19) + 1;
+}
+
+// floor(log10(2^e)) and floor(log10(5^e)), for e up to 1650 and 2620
+static int Log10Pow2(int e) {
+	return (e * 78913) >> 18;
+}
+static int Log10Pow5(int e) {
+	return (e * 732923) >> 20;
+}
+
+static bool MultipleOfPowerOf5(uint64_t value, int p) {
+	int count = 0;
+	while (value % 5 == 0) {
+		value /= 5;
+		++count;
+	}
+	return count >= p;
+}
+
+static bool MultipleOfPowerOf2(uint64_t value, int p) {
+	return (value & ((UINT64_C(1) << p) - 1)) == 0;
+}
+
+// (m * mul) >> j, for j of at least 64
+static uint64_t MulShift(uint64_t m, const uint64_t *mul, int j) {
+	uint128_t low = (uint128_t) m * mul[0];
+	uint128_t high = (uint128_t) m * mul[1];
+	return (uint64_t) (((low >> 64) + high) >> (j - 64));
+}
+
+// the digits and decimal exponent of the shortest decimal rounding to the
+// finite, nonzero double with these fields
+static void ShortestDecimal(uint64_t mantissa, uint32_t exponent, uint64_t &digits, int &exponent10) {
+	int e2;
+	uint64_t m2;
+	if (exponent == 0) {
+		e2 = 1 - ExponentBias - MantissaBits - 2;
+		m2 = mantissa;
+	} else {
+		e2 = (int) exponent - ExponentBias - MantissaBits - 2;
+		m2 = (UINT64_C(1) << MantissaBits) | mantissa;
+	}
+	// round to even, the bounds belong to the interval for even mantissas
+	bool acceptBounds = (m2 & 1) == 0;
+
+	// the interval is [4 * m2 - 1 - mmShift, 4 * m2 + 2] * 2^e2, narrower
+	// below powers of two
+	uint64_t mv = 4 * m2;
+	uint32_t mmShift = mantissa != 0 || exponent <= 1;
+
+	// vr, vp and vm are mv, its upper and its lower bound times 2^e2 / 10^e10
+	uint64_t vr, vp, vm;
+	int e10;
+	bool vmIsTrailingZeros = false;
+	bool vrIsTrailingZeros = false;
+	if (e2 >= 0) {
+		int q = Log10Pow2(e2) - (e2 > 3);
+		e10 = q;
+		int k = Pow5InvBits + Pow5BitCount(q) - 1;
+		int i = -e2 + q + k;
+		vr = MulShift(4 * m2, Pow5InvSplit[q], i);
+		vp = MulShift(4 * m2 + 2, Pow5InvSplit[q], i);
+		vm = MulShift(4 * m2 - 1 - mmShift, Pow5InvSplit[q], i);
+		if (q <= 21) {
+			// only one of mv, mp and mm can be a multiple of 5, if any
+			if (mv % 5 == 0)
+				vrIsTrailingZeros = MultipleOfPowerOf5(mv, q);
+			else if (acceptBounds)
+				vmIsTrailingZeros = MultipleOfPowerOf5(mv - 1 - mmShift, q);
+			else
+				vp -= MultipleOfPowerOf5(mv + 2, q);
+		}
+	} else {
+		int q = Log10Pow5(-e2) - (-e2 > 1);
+		e10 = q + e2;
+		int i = -e2 - q;
+		int k = Pow5BitCount(i) - Pow5Bits;
+		int j = q - k;
+		vr = MulShift(4 * m2, Pow5Split[i], j);
+		vp = MulShift(4 * m2 + 2, Pow5Split[i], j);
+		vm = MulShift(4 * m2 - 1 - mmShift, Pow5Split[i], j);
+		if (q <= 1) {
+			// mv has at least q trailing zero bits, mp and mm at most one
+			vrIsTrailingZeros = true;
+			if (acceptBounds)
+				vmIsTrailingZeros = mmShift == 1;
+			else
+				--vp;
+		} else if (q < 63) {
+			vrIsTrailingZeros = MultipleOfPowerOf2(mv, q);
+		}
+	}
+
+	// drop digits while the bounds still differ in the remaining ones
+	int removed = 0;
+	uint64_t output;
+	if (vmIsTrailingZeros || vrIsTrailingZeros) {
+		// rare, the exact values of the bounds matter
+		uint32_t lastRemovedDigit = 0;
+		while (vp / 10 > vm / 10) {
+			vmIsTrailingZeros &= vm % 10 == 0;
+			vrIsTrailingZeros &= lastRemovedDigit == 0;
+			lastRemovedDigit = vr % 10;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			++removed;
+		}
+		if (vmIsTrailingZeros) {
+			while (vm % 10 == 0) {
+				vrIsTrailingZeros &= lastRemovedDigit == 0;
+				lastRemovedDigit = vr % 10;
+				vr /= 10;
+				vp /= 10;
+				vm /= 10;
+				++removed;
+			}
+		}
+		// exactly halfway rounds to even
+		if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0)
+			lastRemovedDigit = 4;
+		output = vr + ((vr == vm && ( !acceptBounds || !vmIsTrailingZeros)) || lastRemovedDigit >= 5);
+	} else {
+		bool roundUp = false;
+		if (vp / 100 > vm / 100) {
+			roundUp = vr % 100 >= 50;
+			vr /= 100;
+			vp /= 100;
+			vm /= 100;
+			removed += 2;
+		}
+		while (vp / 10 > vm / 10) {
+			roundUp = vr % 10 >= 5;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			++removed;
+		}
+		output = vr + (vr == vm || roundUp);
+	}
+
+	digits = output;
+	exponent10 = e10 + removed;
+}
+
+int FormatDouble(double num, char *out) {
+	// whole numbers are the common case, and need no more than their digits
+	if (num == floor(num) && fabs(num) < 1e15) {
+		char digits[20];
+		int count = 0;
+		uint64_t value = (uint64_t) fabs(num);
+		do {
+			digits[count++] = '0' + value % 10;
+			value /= 10;
+		} while (value != 0);
+
+		int length = 0;
+		if (signbit(num))
+			out[length++] = '-';
+		while (count > 0)
+			out[length++] = digits[--count];
+		return length;
+	}
+
+	uint64_t bits;
+	memcpy( &bits, &num, sizeof(bits));
+	uint64_t mantissa = bits & ((UINT64_C(1) << MantissaBits) - 1);
+	uint32_t exponent = (bits >> MantissaBits) & ((1u << ExponentBits) - 1);
+	bool negative = bits >> 63;
+
+	int length = 0;
+	if (exponent == (1u << ExponentBits) - 1) {
+		if (mantissa != 0) {
+			memcpy(out, "nan", 3);
+			return 3;
+		}
+		if (negative)
+			out[length++] = '-';
+		memcpy(out + length, "inf", 3);
+		return length + 3;
+	}
+
+	uint64_t value;
+	int exponent10;
+	ShortestDecimal(mantissa, exponent, value, exponent10);
+	while (value % 10 == 0) {
+		value /= 10;
+		++exponent10;
+	}
+
+	char digits[20];
+	int count = 0;
+	for (; value != 0; value /= 10)
+		digits[count++] = '0' + value % 10;
+	// digits are in reverse, the first one is digits[count - 1]
+	int point = exponent10 + count - 1;
+
+	if (negative)
+		out[length++] = '-';
+
+	// as %g does, exponents for very small or large numbers
+	if (point < -4 || point >= 15) {
+		out[length++] = digits[--count];
+		if (count > 0) {
+			out[length++] = '.';
+			while (count > 0)
+				out[length++] = digits[--count];
+		}
+		out[length++] = 'e';
+		out[length++] = point < 0 ? '-' : '+';
+		int magnitude = point < 0 ? -point : point;
+		if (magnitude >= 100)
+			out[length++] = '0' + magnitude / 100;
+		out[length++] = '0' + magnitude / 10 % 10;
+		out[length++] = '0' + magnitude % 10;
+		return length;
+	}
+
+	if (point < 0) {
+		out[length++] = '0';
+		out[length++] = '.';
+		for (int i = -1; i > point; --i)
+			out[length++] = '0';
+		while (count > 0)
+			out[length++] = digits[--count];
+		return length;
+	}
+
+	for (int i = 0; i <= point; ++i)
+		out[length++] = count > 0 ? digits[--count] : '0';
+	if (count > 0) {
+		out[length++] = '.';
+		while (count > 0)
+			out[length++] = digits[--count];
+	}
+	return length;
+}
@@ -0,0 +1,10 @@
+#ifndef DOUBLEFORMAT_HPP
+#define DOUBLEFORMAT_HPP
+
+// num as the shortest text reading back as the same double, returns its
+// length. out has room for 32 characters. Whole numbers below 1e15 are
+// written in full, other numbers as printf's %g would with just enough
+// digits: 0.1, 1e-05, 5e-324, 1.7976931348623157e+308.
+int FormatDouble(double num, char *out);
+
+#endif
@@ -1,29 +1,56 @@
 #include "Driver.hpp"
+#include "BuiltIns.hpp"
 
 void Driver::HandleDefinition() {
 	FunctionAST *func = TheParser.ParseDefinition();
-	Function *code = Gen->Generate(func);
+	Function *code = 0;
+	if (func && Gen->IsLazy())
+		code = Gen->GenerateLazily(func, TheParser.TakeArena());
+	else if (func)
+		code = Gen->Generate(func, TheParser.TakeArena());
 	if ( !(func && code))
 	TheParser.GetNextToken();
+	else
+		Definitions.insert(code->getName().str());
+
+	// the generated code no longer needs the AST
+	TheParser.ReleaseAST();
 }
 
 void Driver::HandleImport() {
 	ImportAST *imp = TheParser.ParseImport();
+	if ( !imp) {
+		TheParser.GetNextToken();
+		return;
+	}
 
-	Driver *driver = new Driver(Gen);
-	driver->Go(imp->FileName + ".wtf");
-
-	// set lexer back to this drivers parser's, to give correct debug locations
-	BaseError::SetLexer(TheParser.GetLexer());
+	string file = imp->FileName.str() + ".wtf";
+	Record.Imports.push_back(make_pair(file, this->Import(file)));
 
 	TheParser.GetNextToken();
+	TheParser.ReleaseAST();
 }
 
 void Driver::HandleOperator() {
 	OperatorAST *func = TheParser.ParseOperator();
-	Function *code = Gen->Generate(func);
-	if ( !(func && code))
+
+	// the parser has installed the precedence either way
+	if (func)
+		Record.Operators.push_back(make_pair(func->GetOp(), func->GetPrecedence()));
+
+	// codegen keeps the AST of operators it can substitute at their uses
+	Function *code = 0;
+	if (func && Gen->IsLazy())
+		code = Gen->GenerateLazily(func, TheParser.TakeArena());
+	else if (func)
+		code = Gen->Generate(func, TheParser.TakeArena());
+	if ( !code)
 	TheParser.GetNextToken();
+	else
+		Definitions.insert(code->getName().str());
+
+	// the generated code no longer needs the AST
+	TheParser.ReleaseAST();
 }
 
 void Driver::HandleExtern() {
@@ -32,42 +59,208 @@ void Driver::HandleExtern() {
 	// try recovering by ignoring current token
 	if ( !(ext && code))
 	TheParser.GetNextToken();
+	else
+		Definitions.insert(code->getName().str());
+
+	TheParser.ReleaseAST();
 }
 
 void Driver::HandleTopLevelExpr() {
 	FunctionAST *expr = TheParser.ParseTopLevelExpr();
-	Function *code = Gen->Generate(expr);
-	if (expr && code) {
-		llvm::ExecutionEngine* execEngine = Gen->GetExecEngine();
-		// execute the anonymous wrapper function
-		void *funcPtr = execEngine->getPointerToFunction(code);
-		double (*fptr)() = (double (*)())(intptr_t)funcPtr;
-		fptr();
-	}
+	Cacheable = false;
+	if (expr)
+		PendingExprs.push_back(expr);
 	else
 	TheParser.GetNextToken();
+
+	// the queued expressions still live in the parser's arena
+	if (PendingExprs.empty())
+		TheParser.ReleaseAST();
+}
+
+// compile the queued top level expressions into one function and run it
+void Driver::FlushTopLevelExprs() {
+	if (PendingExprs.empty())
+		return;
+
+	llvm::ExecutionEngine* execEngine = Gen->GetExecEngine();
+	// expressions computing with constants need no code, unless compiling
+	// ahead of time where main runs them
+	Evaluator *eval = Gen->GetEvaluator();
+	if (eval && eval->Run(PendingExprs)) {
+		PendingExprs.clear();
+		TheParser.ReleaseAST();
+		return;
+	}
+
+	// optimize the definitions read since the last expressions before the
+	// JIT compiles any of them. Earlier ones were optimized then and are
+	// left alone, so a streamed item costs the same however long the
+	// stream has run.
+	if (execEngine)
+		Gen->RunModulePasses();
+
+	Function *code = Gen->GenerateTopLevel(PendingExprs);
+	PendingExprs.clear();
+	TheParser.ReleaseAST();
+
+	if (code)
+		this->Run(code);
+}
+
+// run a function of top level code, which nothing can call again
+void Driver::Run(Function *code) {
+	llvm::ExecutionEngine* execEngine = Gen->GetExecEngine();
+
+	// compiling ahead of time, main will run it
+	if ( !execEngine) {
+		Gen->AddTopLevelFunction(code);
+		return;
+	}
+
+	// execute the anonymous wrapper function
+	void *funcPtr = execEngine->getPointerToFunction(code);
+	double (*fptr)() = (double (*)())(intptr_t)funcPtr;
+	fptr();
+
+	// nothing can call it again
+	execEngine->freeMachineCodeForFunction(code);
+	code->eraseFromParent();
+}
+
+// load an imported file unless it has been before, and return its cache key
+string Driver::Import(string file) {
+	ImportRegistry::File *imported = Session.GetImports().Find(file);
+	if (imported->State == ImportRegistry::Loading) {
+		Session.GetDiagnostics().Throw<int>(str(boost::format("Import cycle through '%1%'") % file));
+		return "";
+	}
+
+	if (imported->State == ImportRegistry::Unloaded) {
+		imported->State = ImportRegistry::Loading;
+		imported->Key = this->Load(file);
+		imported->State = ImportRegistry::Loaded;
+
+		// set lexer back to this drivers parser's, the imported file's is gone
+		Session.GetDiagnostics().SetLexer(TheParser.GetLexer());
+	}
+	return imported->Key;
+}
+
+// load an imported file, from the cache if possible, and return its cache key
+string Driver::Load(string file) {
+	if (Graph && Graph->Contains(file)) {
+		// the declarations are all a standalone file needs
+		if (Standalone)
+			return Graph->GetKey(file);
+
+		vector<string> inits;
+		Graph->Link(file, Gen, TheParser, inits);
+
+		if (Gen->GetExecEngine() && !inits.empty())
+			Gen->RunModulePasses();
+		for (unsigned i = 0; i < inits.size(); ++i)
+			if (Function *init = Gen->GetModule()->getFunction(inits[i]))
+				this->Run(init);
+		return Graph->GetKey(file);
+	}
+
+	// all of a standalone file's imports are in the graph, unless missing
+	if (Standalone) {
+		Session.GetDiagnostics().Throw<int>(str(boost::format("File not found: '%1%'") % file));
+		return "";
+	}
+
+	if ( !Cache) {
+		Driver driver(Session, Gen);
+		driver.Go(file);
+		return "";
+	}
+
+	string context = ModuleCache::GetContext(Session.GetPrecedence(), Gen->DescribeInlineOperators());
+	string key = Cache->GetKey(file, context);
+	ModuleCache::Entry entry;
+	if ( !key.empty() && Cache->LoadEntry(key, entry) && Cache->IsValid(entry)
+			&& this->LoadCached(key, entry))
+		return key;
+
+	int errors = Session.GetDiagnostics().GetCount();
+	Driver driver(Session, Gen, Cache);
+	driver.Go(file);
+
+	if ( !key.empty() && driver.Cacheable && Session.GetDiagnostics().GetCount() == errors) {
+		Module *module = Gen->CloneDefinitions(driver.Definitions);
+		driver.Record.Context = context;
+		Cache->Store(key, driver.Record, module);
+		delete module;
+	}
+
+	return key;
+}
+
+bool Driver::LoadCached(string key, const ModuleCache::Entry &entry) {
+	Module *module = Cache->LoadModule(key, Gen->GetModule()->getContext());
+	if ( !module)
+		return false;
+
+	// the entry was validated, so its own imports come from the cache as well
+	for (unsigned i = 0; i < entry.Imports.size(); ++i)
+		this->Import(entry.Imports[i].first);
+
+	for (unsigned i = 0; i < entry.Operators.size(); ++i)
+		TheParser.SetPrecedence(entry.Operators[i].first, entry.Operators[i].second);
+
+	return Gen->LinkModule(module);
 }
 
 void Driver::Go(string file) {
 	CurrentFile = file;
+
+	// the file importing itself, directly or not, is a cycle
+	ImportRegistry::File *self = Session.GetImports().Find(file);
+	self->State = ImportRegistry::Loading;
+
 	TheParser.SetInputFile(file, 0);
+	this->MainLoop();
+
+	self->State = ImportRegistry::Loaded;
+}
+
+void Driver::GoSource(string name, StringRef source) {
+	CurrentFile = name;
+	TheParser.SetInputString(name, source);
+	this->MainLoop();
+}
+
+void Driver::GoStream(string name, FILE *stream) {
+	CurrentFile = name;
+	Streaming = true;
+	TheParser.SetInputStream(name, stream);
+	this->MainLoop();
+}
 
+void Driver::MainLoop() {
 	TheParser.GetNextToken();
 
 	while (1) {
 		switch (TheParser.GetCurTok()) {
 			case tok_eof:
+				FlushTopLevelExprs();
 				return;
 			case tok_func:
+				FlushTopLevelExprs();
 				HandleDefinition();
 				break;
 			case tok_extern:
+				FlushTopLevelExprs();
 				HandleExtern();
 				break;
 			case tok_op:
+				FlushTopLevelExprs();
 				HandleOperator();
 				break;
 			case tok_import:
+				FlushTopLevelExprs();
 				HandleImport();
 				break;
 			case tok_end:
@@ -76,6 +269,11 @@ void Driver::Go(string file) {
 				break;
 			default:
 				HandleTopLevelExpr();
+				// the writer of the stream may wait for its output
+				if (Streaming) {
+					FlushTopLevelExprs();
+					pflush();
+				}
 				break;
 		}
 	}
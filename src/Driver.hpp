@@ -9,8 +9,11 @@
 #include "Parser.hpp"
 #include "Errors.hpp"
 #include "Codegen.hpp"
+#include "ModuleCache.hpp"
+#include "ImportGraph.hpp"
 
 #include <iostream>
+#include <set>
 
 #ifndef DRIVER_HPP
 #define DRIVER_HPP
@@ -19,21 +22,65 @@ using namespace std;
 using namespace llvm;
 
 class Driver {
+	CompilerSession &Session;
 	Parser TheParser;
 	Codegen *Gen;
 	string CurrentFile;
 
+	// cache for imported files, 0 if disabled
+	ModuleCache *Cache;
+	// imports compiled in advance with -j, 0 if they are read in place
+	ImportGraph *Graph;
+	// compiling one of Graph's files, its imports are only declared
+	bool Standalone;
+	// what this file contributes, recorded for its cache entry
+	ModuleCache::Entry Record;
+	set<string> Definitions;
+	// files running top level expressions cannot be cached
+	bool Cacheable;
+	// reading a stream, whose top level expressions run as they arrive
+	bool Streaming;
+	// consecutive top level expressions, run together at the next
+	// definition or the end of the file
+	vector<FunctionAST*> PendingExprs;
+
 public:
-	Driver(Codegen *codegen)
-			: Gen(codegen) {
+	// codegen generates into a module of session's context. Standalone
+	// drivers compile a file of graph on its own, in a session of its own.
+	Driver(CompilerSession &session, Codegen *codegen, ModuleCache *cache = 0, ImportGraph *graph = 0,
+			bool standalone = false)
+			: Session(session), TheParser(session), Gen(codegen), Cache(cache), Graph(graph),
+			  Standalone(standalone), Cacheable(true), Streaming(false) {
 	}
 	void Go(string file);
+	// compile source held in memory, name stands in for the file in errors
+	void GoSource(string name, StringRef source);
+	// compile and run stream item by item as it is written, until it ends.
+	// Items ending in ';' or 'end' run without waiting for the next one.
+	void GoStream(string name, FILE *stream);
+
+	const ModuleCache::Entry &GetRecord() {
+		return this->Record;
+	}
+	const set<string> &GetDefinitions() {
+		return this->Definitions;
+	}
+	bool IsCacheable() {
+		return this->Cacheable;
+	}
 
 private:
+	void MainLoop();
+	string Import(string file);
+	string Load(string file);
+	bool LoadCached(string key, const ModuleCache::Entry &entry);
+
 	void HandleDefinition();
 	void HandleOperator();
 	void HandleExtern();
 	void HandleTopLevelExpr();
+	void FlushTopLevelExprs();
+	void Run(Function *code);
 	void HandleImport();
 };
 
@@ -0,0 +1,175 @@
+#include "Engine.hpp"
+#include "Driver.hpp"
+#include "BuiltIns.hpp"
+#include "ExpressionCache.hpp"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/DynamicLibrary.h"
+
+#include <mutex>
+
+// the host links the runtime in, but need not export it to the JIT the way
+// bin/wtf does with -rdynamic
+static void AddRuntimeSymbols() {
+	sys::DynamicLibrary::AddSymbol("pchar", (void*) pchar);
+	sys::DynamicLibrary::AddSymbol("pdoub", (void*) pdoub);
+	sys::DynamicLibrary::AddSymbol("pline", (void*) pline);
+	sys::DynamicLibrary::AddSymbol("pflush", (void*) pflush);
+	sys::DynamicLibrary::AddSymbol("pchars", (void*) pchars);
+	sys::DynamicLibrary::AddSymbol("pvals", (void*) pvals);
+	sys::DynamicLibrary::AddSymbol("wait", (void*) wait);
+	sys::DynamicLibrary::AddSymbol("clrscr", (void*) clrscr);
+	sys::DynamicLibrary::AddSymbol("wtf_alloc", (void*) wtf_alloc);
+	sys::DynamicLibrary::AddSymbol("wtf_free", (void*) wtf_free);
+	sys::DynamicLibrary::AddSymbol("wtf_bounds_fail", (void*) wtf_bounds_fail);
+	sys::DynamicLibrary::AddSymbol("wtf_pfor", (void*) wtf_pfor);
+	sys::DynamicLibrary::AddSymbol("wtf_print", (void*) wtf_print);
+}
+
+// the target registry and the symbol table are not safe to fill from
+// engines set up on several threads at once
+static once_flag ProcessSetUp;
+
+static void SetUpProcess() {
+	InitializeNativeTarget();
+	AddRuntimeSymbols();
+}
+
+Engine::Engine(unsigned optLevel, unsigned cachedExpressions)
+		: ExecEngine(0), Gen(0), Expressions(0) {
+	call_once(ProcessSetUp, SetUpProcess);
+
+	// errors are only collected
+	Session = new CompilerSession(0);
+	TheModule = new Module("WTFEngine", Session->GetContext());
+
+	string errStr;
+	ExecEngine = EngineBuilder(TheModule).setErrorStr( &errStr)
+			.setOptLevel(Codegen::CodeGenLevel(optLevel)).create();
+	if ( !ExecEngine) {
+		Session->GetDiagnostics().Throw<int>("Could not create ExecutionEngine: " + errStr);
+		return;
+	}
+
+	Gen = new Codegen( *Session, ExecEngine, TheModule, optLevel);
+	Expressions = new ExpressionCache( *Session, ExecEngine, TheModule, cachedExpressions);
+}
+
+Engine::~Engine() {
+	delete Expressions;
+	delete Gen;
+	// the execution engine owns the module
+	if (ExecEngine)
+		delete ExecEngine;
+	else
+		delete TheModule;
+	delete Session;
+}
+
+bool Engine::Compile(string source, string name) {
+	Diagnostics &diag = Session->GetDiagnostics();
+	if ( !Gen)
+		return false;
+
+	int errors = diag.GetCount();
+	{
+		Driver driver( *Session, Gen);
+		driver.GoSource(name, source);
+	}
+	// the driver's lexer is gone
+	diag.SetLexer(0);
+
+	return diag.GetCount() == errors;
+}
+
+const vector<string> &Engine::GetErrors() {
+	return Session->GetDiagnostics().GetMessages();
+}
+
+Function *Engine::Lookup(string name, unsigned arity) {
+	Diagnostics &diag = Session->GetDiagnostics();
+	if ( !Gen)
+		return 0;
+
+	Function *func = TheModule->getFunction(name);
+	if ( !func || func->hasLocalLinkage())
+		return diag.Throw<Function*>(str(boost::format("Unknown function '%1%'") % name));
+
+	FunctionType *type = func->getFunctionType();
+	if (type->getNumParams() != arity)
+		return diag.Throw<Function*>(str(boost::format("'%1%' takes %2% parameters, not %3%")
+				% name % type->getNumParams() % arity));
+	for (unsigned i = 0; i < arity; ++i)
+		if ( !type->getParamType(i)->isDoubleTy())
+			return diag.Throw<Function*>(str(boost::format("'%1%' takes arrays, only doubles can be passed to it")
+					% name));
+
+	// definitions since the last top level expression are not optimized
+	// together yet
+	Gen->RunModulePasses();
+	return func;
+}
+
+void *Engine::GetPointer(string name, unsigned arity) {
+	Function *func = this->Lookup(name, arity);
+	return func ? ExecEngine->getPointerToFunction(func) : 0;
+}
+
+bool Engine::Evaluate(string name, const double *const *columns, unsigned arity, double *out, int64_t rows,
+		bool parallel) {
+	map<string, pair<void*, unsigned> >::iterator it = Batches.find(name);
+	if (it == Batches.end() || it->second.second != arity) {
+		Function *func = this->Lookup(name, arity);
+		if ( !func)
+			return false;
+
+		void *code = ExecEngine->getPointerToFunction(Gen->GenerateBatch(func));
+		it = Batches.insert(make_pair(name, make_pair(code, arity))).first;
+	}
+
+	// the output column first, as the batch function expects
+	vector<const double*> env(1, out);
+	env.insert(env.end(), columns, columns + arity);
+
+	double (*batch)(void*, int64_t, int64_t) = (double (*)(void*, int64_t, int64_t))(intptr_t) it->second.first;
+	if (parallel)
+		wtf_pfor(batch, (void*) &env[0], rows, 0);
+	else
+		batch((void*) &env[0], 0, rows);
+	return true;
+}
+
+void *Engine::GetExpressionPointer(string expr, string params, unsigned arity) {
+	Diagnostics &diag = Session->GetDiagnostics();
+	if ( !Gen)
+		return 0;
+
+	SmallVector<StringRef, 8> names;
+	SplitString(params, names);
+	if (names.size() != arity)
+		return diag.Throw<void*>(str(boost::format("'%1%' names %2% parameters, not %3%")
+				% params % names.size() % arity));
+
+	string key = Expressions->GetKey(names, expr);
+	if (void *code = Expressions->Lookup(key))
+		return code;
+
+	Function *func = 0;
+	{
+		Parser parser( *Session);
+		parser.SetInputString("<expression>", expr);
+		parser.GetNextToken();
+		if (FunctionAST *ast = parser.ParseExpressionFunction(Expressions->GetNewName(), names))
+			func = Gen->Generate(ast);
+	}
+	// the parser's lexer is gone
+	diag.SetLexer(0);
+	if ( !func)
+		return 0;
+
+	Gen->RunModulePasses();
+	void *code = ExecEngine->getPointerToFunction(func);
+	Expressions->Insert(key, func, code);
+	return code;
+}
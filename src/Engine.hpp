@@ -0,0 +1,116 @@
+#ifndef ENGINE_HPP
+#define ENGINE_HPP
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <type_traits>
+
+using namespace std;
+
+class CompilerSession;
+class Codegen;
+class ExpressionCache;
+namespace llvm {
+	class ExecutionEngine;
+	class Function;
+	class Module;
+}
+
+// whether every type of a parameter pack is double
+template<class... Params>
+struct AllDoubles;
+template<>
+struct AllDoubles<> {
+	enum { Value = true };
+};
+template<class First, class... Rest>
+struct AllDoubles<First, Rest...> {
+	enum { Value = is_same<First, double>::value && AllDoubles<Rest...>::Value };
+};
+
+// The compiler as a library (bin/libwtf.a), for programs using WTF as an
+// expression engine. Sources are compiled from memory by the JIT into one
+// module, so later sources can use the functions and operators of earlier
+// ones, and compiled functions are called through plain function pointers:
+//
+//     Engine engine;
+//     if ( !engine.Compile("func axpy(a x y) a * x + y; end"))
+//         ...engine.GetErrors()...
+//     double (*axpy)(double, double, double) = engine.GetFunction<double, double, double>("axpy");
+//
+// Formulas can also be compiled on their own, as the body of a function of
+// the parameters named:
+//
+//     double (*f)(double, double) = engine.GetExpression<double, double>("x * x + y", "x y");
+//
+// The same expression asked for again, however it is spaced, comes from a
+// cache of the most recently used ones without being compiled again, as long
+// as the names in it still stand for the same definitions. The pointer is
+// only valid until the expression is evicted, once as many other
+// expressions as the cache holds have been used since.
+//
+// Top level expressions in a source run while it is compiled. Errors are
+// collected instead of printed. An engine compiles on one thread at a time,
+// the functions it returns can be called from any thread for as long as it
+// exists.
+class Engine {
+	CompilerSession *Session;
+	llvm::Module *TheModule;
+	llvm::ExecutionEngine *ExecEngine;
+	Codegen *Gen;
+	ExpressionCache *Expressions;
+	// batch function and arity of the functions Evaluate has run
+	map<string, pair<void*, unsigned> > Batches;
+
+	Engine(const Engine&);
+	Engine &operator=(const Engine&);
+
+	// the function name taking arity doubles, 0 after reporting an error
+	llvm::Function *Lookup(string name, unsigned arity);
+
+public:
+	// optLevel is that of -O<optLevel>, up to cachedExpressions expressions
+	// are kept compiled
+	Engine(unsigned optLevel = 2, unsigned cachedExpressions = 1024);
+	~Engine();
+
+	// compile source, name stands in for a file name in errors. False if
+	// there were errors, what compiled without them can still be used.
+	bool Compile(string source, string name = "<source>");
+	// every error so far, with its location
+	const vector<string> &GetErrors();
+
+	// the machine code of the function name taking arity doubles, 0 after
+	// reporting an error if there is no such function
+	void *GetPointer(string name, unsigned arity);
+
+	template<class... Params>
+	double (*GetFunction(string name))(Params...) {
+		static_assert(AllDoubles<Params...>::Value, "WTF functions take doubles");
+		return (double (*)(Params...))(intptr_t) this->GetPointer(name, sizeof...(Params));
+	}
+
+	// the machine code of expr as a function of params, names separated by
+	// spaces, which must be arity many. 0 after reporting an error if it
+	// does not compile.
+	void *GetExpressionPointer(string expr, string params, unsigned arity);
+
+	// out[i] = name(columns[0][i], ..., columns[arity - 1][i]) for every i
+	// below rows, false after reporting an error if there is no function
+	// name taking arity doubles. The function is inlined into a loop over
+	// the rows, vectorized where possible, which runs on the threads of
+	// pfor loops if parallel is set. The columns must not overlap out.
+	bool Evaluate(string name, const double *const *columns, unsigned arity, double *out, int64_t rows,
+			bool parallel = false);
+
+	template<class... Params>
+	double (*GetExpression(string expr, string params = ""))(Params...) {
+		static_assert(AllDoubles<Params...>::Value, "WTF functions take doubles");
+		return (double (*)(Params...))(intptr_t) this->GetExpressionPointer(expr, params, sizeof...(Params));
+	}
+};
+
+#endif
@@ -3,6 +3,18 @@
 #ifndef ERRORS_CPP
 #define ERRORS_CPP
 
-Lexer *BaseError::Lex;
+void Diagnostics::Report(string message) {
+	++Count;
+	if (Lex)
+		message = str(boost::format("%1%, in %2%:%3%:%4%")
+				% message
+				% Lex->GetFile()
+				% Lex->GetCursorLinePosition()
+				% Lex->GetCursorColumnPosition());
+	Messages.push_back(message);
+
+	if (Output)
+		fprintf(Output, "Error: %s\n", message.c_str());
+}
 
 #endif
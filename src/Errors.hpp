@@ -3,26 +3,56 @@
 
 #include "llvm/Value.h"
 #include "boost/format.hpp"
+#include <atomic>
+#include <cstdio>
+#include <vector>
 #include "Lexer.hpp"
 #include "AST.hpp"
 
-class BaseError {
-	static Lexer *Lex;
+// Where the errors of a compilation go. Locations come from the lexer
+// reading at the time, which parsers install as they start.
+class Diagnostics {
+	Lexer *Lex;
+	// imports compiled on other threads add their errors
+	atomic<int> Count;
+	// 0 to only keep the messages
+	FILE *Output;
+	vector<string> Messages;
+
+	void Report(string message);
+
 	public:
-	static void SetLexer(Lexer *lexer) {
-		BaseError::Lex = lexer;
+	Diagnostics(FILE *output = stderr)
+			: Lex(0), Count(0), Output(output) {
+	}
+
+	void SetLexer(Lexer *lexer) {
+		this->Lex = lexer;
+	}
+	Lexer *GetLexer() {
+		return this->Lex;
+	}
+	FILE *GetOutput() {
+		return this->Output;
+	}
+
+	// number of errors reported so far
+	int GetCount() {
+		return this->Count;
+	}
+	void AddCount(int count) {
+		this->Count += count;
+	}
+	// the errors reported here, with their locations
+	const vector<string> &GetMessages() {
+		return this->Messages;
 	}
 
 	template<class T>
-	static T Throw(string message) {
-		fprintf(stderr, "Error: %s, in %s:%i:%i\n",
-				message.c_str(),
-				BaseError::Lex->GetFile().c_str(),
-				BaseError::Lex->GetCursorLinePosition(),
-				BaseError::Lex->GetCursorColumnPosition());
+	T Throw(string message) {
+		this->Report(message);
 		return 0;
 	}
 };
 
 #endif
-
@@ -0,0 +1,478 @@
+#include "Evaluator.hpp"
+#include "BuiltIns.hpp"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <cmath>
+
+bool FoldBinary(char op, double lhs, double rhs, double &result) {
+	switch (op) {
+		case '+':
+			result = lhs + rhs;
+			return true;
+		case '-':
+			result = lhs - rhs;
+			return true;
+		case '*':
+			result = lhs * rhs;
+			return true;
+		case '/':
+			result = lhs / rhs;
+			return true;
+		case '<':
+			// true when either side is NaN, like the generated comparison
+			result = !(lhs >= rhs);
+			return true;
+		default:
+			return false;
+	}
+}
+
+struct KnownFunction {
+	const char *Name;
+	unsigned Arity;
+	// a builtin of codegen, called without an extern
+	bool Builtin;
+	// prints, called once the expressions have all run
+	bool Output;
+	double (*Call)(const double *args);
+};
+
+static double Sqrt(const double *args) {
+	return sqrt(args[0]);
+}
+static double Sin(const double *args) {
+	return sin(args[0]);
+}
+static double Cos(const double *args) {
+	return cos(args[0]);
+}
+static double Tan(const double *args) {
+	return tan(args[0]);
+}
+static double Exp(const double *args) {
+	return exp(args[0]);
+}
+static double Log(const double *args) {
+	return log(args[0]);
+}
+static double Fabs(const double *args) {
+	return fabs(args[0]);
+}
+static double Floor(const double *args) {
+	return floor(args[0]);
+}
+static double Pow(const double *args) {
+	return pow(args[0], args[1]);
+}
+static double Fma(const double *args) {
+	return fma(args[0], args[1], args[2]);
+}
+static double PChar(const double *args) {
+	return pchar(args[0]);
+}
+static double PDoub(const double *args) {
+	return pdoub(args[0]);
+}
+static double PLine(const double *) {
+	return pline();
+}
+static double ClrScr(const double *) {
+	return clrscr();
+}
+static double PFlush(const double *) {
+	return pflush();
+}
+
+// the libm functions give what the JIT's calls and folding give
+static const KnownFunction KnownFunctions[] = {
+	{ "sqrt", 1, true, false, Sqrt },
+	{ "sin", 1, true, false, Sin },
+	{ "cos", 1, true, false, Cos },
+	{ "exp", 1, true, false, Exp },
+	{ "log", 1, true, false, Log },
+	{ "fabs", 1, true, false, Fabs },
+	{ "floor", 1, true, false, Floor },
+	{ "pow", 2, true, false, Pow },
+	{ "fma", 3, true, false, Fma },
+	{ "tan", 1, false, false, Tan },
+	{ "pchar", 1, false, true, PChar },
+	{ "pdoub", 1, false, true, PDoub },
+	{ "pline", 0, false, true, PLine },
+	{ "clrscr", 0, false, true, ClrScr },
+	{ "pflush", 0, false, true, PFlush },
+};
+
+// the condition of an 'if' or a loop holds
+static bool IsTrue(double cond) {
+	return cond == cond && cond != 0;
+}
+
+// matches what the evaluator never runs
+struct Unsupported {
+	bool operator()(const ExprAST *expr) const {
+		if (const ForExprAST *loop = dyn_cast<ForExprAST>(expr))
+			return loop->IsParallel();
+		return isa<ArrayExprAST>(expr) || isa<IndexExprAST>(expr);
+	}
+};
+
+// counts the expressions it is shown, matching none
+struct CountNodes {
+	unsigned &Count;
+
+	bool operator()(const ExprAST *expr) const {
+		++Count;
+		return false;
+	}
+};
+
+Evaluator::Evaluator(Module *module)
+		: TheModule(module), KeptNodes(0), Steps(0), Depth(0) {
+}
+
+bool Evaluator::Define(StringRef name, ArrayRef<StringRef> args, const BlockAST *body) {
+	// a redefinition that cannot be kept must not leave the old AST behind
+	Definitions.erase(name.str());
+	if (AnyExpr(body, Unsupported()))
+		return false;
+
+	unsigned nodes = 0;
+	CountNodes count = { nodes };
+	AnyExpr(body, count);
+	if (nodes > MaxDefinitionNodes || KeptNodes + nodes > MaxKeptNodes)
+		return false;
+	KeptNodes += nodes;
+
+	CopyExpr copy(Kept);
+	Definition def = { copy.Copy(args), copy.Copy(body) };
+	Definitions[name.str()] = def;
+	return true;
+}
+
+bool Evaluator::Run(ArrayRef<FunctionAST*> exprs) {
+	for (unsigned i = 0; i < exprs.size(); ++i) {
+		// every expression has a scope of its own, as in GenerateTopLevel
+		set<string> names;
+		if ( !this->Check(exprs[i]->GetBody(), names))
+			return false;
+	}
+
+	Steps = 0;
+	Depth = 0;
+	Effects.clear();
+	Values.clear();
+
+	for (unsigned i = 0; i < exprs.size(); ++i) {
+		Frame frame;
+		double result;
+		if ( !this->Evaluate(exprs[i]->GetBody(), frame, result))
+			return false;
+	}
+
+	for (unsigned i = 0; i < Effects.size(); ++i) {
+		double *args = Values.data() + Effects[i].First;
+		if (Effects[i].Func)
+			Effects[i].Func->Call(args);
+		else
+			wtf_print(args, Effects[i].Count);
+	}
+	return true;
+}
+
+// calls go where the code generated for them would
+bool Evaluator::Resolve(StringRef name, unsigned arity, Callee &callee) {
+	callee.Def = 0;
+	callee.Func = 0;
+	callee.Print = false;
+
+	Function *func = TheModule->getFunction(name);
+	if (func && ( !func->empty() || func->isMaterializable())) {
+		map<string, Definition>::iterator it = Definitions.find(name.str());
+		if (it == Definitions.end() || it->second.Args.size() != arity)
+			return false;
+
+		callee.Def = &it->second;
+		return true;
+	}
+
+	if ( !func && name == "print") {
+		callee.Print = true;
+		return true;
+	}
+
+	for (unsigned i = 0; i < array_lengthof(KnownFunctions); ++i) {
+		const KnownFunction &known = KnownFunctions[i];
+		if (name != known.Name || arity != known.Arity)
+			continue;
+
+		// declared by an extern, builtins need none
+		if (func ? func->arg_size() == arity : known.Builtin) {
+			callee.Func = &known;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Evaluator::Check(const BlockAST *block, set<string> &names) {
+	if ( !block || block->GetExpressions().empty())
+		return false;
+
+	ArrayRef<ExprAST*> exprs = block->GetExpressions();
+	for (unsigned i = 0; i < exprs.size(); ++i)
+		if ( !this->Check(exprs[i], names))
+			return false;
+	return true;
+}
+
+// Expressions are checked as a whole before any of them runs, so an error
+// codegen would report, even in a branch that is not taken, leaves them to
+// codegen
+bool Evaluator::Check(const ExprAST *expr, set<string> &names) {
+	switch (expr->GetASTType()) {
+		case ASTNumberExpr:
+			return true;
+		case ASTVariableExpr:
+			return names.count(cast<VariableExprAST>(expr)->GetName().str());
+		case ASTBinaryExpr: {
+			const BinaryExprAST *binary = cast<BinaryExprAST>(expr);
+			if (binary->GetOp() == '=') {
+				const VariableExprAST *target = dyn_cast<VariableExprAST>(binary->GetLHS());
+				return target && this->Check(binary->GetRHS(), names) && names.count(target->GetName().str());
+			}
+
+			double folded;
+			return this->Check(binary->GetLHS(), names) && this->Check(binary->GetRHS(), names)
+					&& (FoldBinary(binary->GetOp(), 0, 0, folded)
+							|| Definitions.count(string("binary") + binary->GetOp()));
+		}
+		case ASTUnary: {
+			const UnaryExprAST *unary = cast<UnaryExprAST>(expr);
+			return this->Check(unary->GetOperand(), names) && Definitions.count(string("unary") + unary->GetOp());
+		}
+		case ASTCallExpr: {
+			const CallExprAST *call = cast<CallExprAST>(expr);
+			ArrayRef<ExprAST*> args = call->GetArgs();
+			Callee callee;
+			if ( !this->Resolve(call->GetCallee(), args.size(), callee))
+				return false;
+
+			for (unsigned i = 0; i < args.size(); ++i)
+				if ( !this->Check(args[i], names))
+					return false;
+			return true;
+		}
+		case ASTConditionalExpr: {
+			const ConditionalExprAST *cond = cast<ConditionalExprAST>(expr);
+			ArrayRef<ConditionalElement> conds = cond->GetConds();
+			for (unsigned i = 0; i < conds.size(); ++i)
+				if ( !this->Check(conds[i].GetCond(), names) || !this->Check(conds[i].GetConsequence(), names))
+					return false;
+			return this->Check(cond->GetElse(), names);
+		}
+		case ASTForExpr: {
+			const ForExprAST *loop = cast<ForExprAST>(expr);
+			if (loop->IsParallel() || !this->Check(loop->GetInit(), names))
+				return false;
+
+			string iter = loop->GetIterName().str();
+			bool shadows = names.count(iter);
+			names.insert(iter);
+			bool checked = this->Check(loop->GetBody(), names)
+					&& ( !loop->GetStep() || this->Check(loop->GetStep(), names))
+					&& this->Check(loop->GetEnd(), names);
+			if ( !shadows)
+				names.erase(iter);
+			return checked;
+		}
+		case ASTVar: {
+			const VarExprAST *var = cast<VarExprAST>(expr);
+			if (isa<ArrayExprAST>(var->GetInitialValue()) || !this->Check(var->GetInitialValue(), names))
+				return false;
+
+			names.insert(var->GetName().str());
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+bool Evaluator::Evaluate(const BlockAST *block, Frame &frame, double &result) {
+	if ( !block || block->GetExpressions().empty())
+		return false;
+
+	ArrayRef<ExprAST*> exprs = block->GetExpressions();
+	for (unsigned i = 0; i < exprs.size(); ++i)
+		if ( !this->Evaluate(exprs[i], frame, result))
+			return false;
+	return true;
+}
+
+bool Evaluator::Evaluate(const ExprAST *expr, Frame &frame, double &result) {
+	if (++Steps > StepBudget)
+		return false;
+
+	switch (expr->GetASTType()) {
+		case ASTNumberExpr:
+			result = cast<NumberExprAST>(expr)->GetVal();
+			return true;
+		case ASTVariableExpr: {
+			Frame::iterator it = frame.find(cast<VariableExprAST>(expr)->GetName().str());
+			if (it == frame.end())
+				return false;
+
+			result = it->second;
+			return true;
+		}
+		case ASTBinaryExpr:
+			return this->Evaluate(cast<BinaryExprAST>(expr), frame, result);
+		case ASTUnary: {
+			const UnaryExprAST *unary = cast<UnaryExprAST>(expr);
+			double operand;
+			if ( !this->Evaluate(unary->GetOperand(), frame, operand))
+				return false;
+
+			map<string, Definition>::iterator it = Definitions.find(string("unary") + unary->GetOp());
+			if (it == Definitions.end() || it->second.Args.size() != 1)
+				return false;
+
+			Callee callee = { &it->second, 0, false };
+			return this->Call(callee, operand, result);
+		}
+		case ASTCallExpr:
+			return this->Evaluate(cast<CallExprAST>(expr), frame, result);
+		case ASTConditionalExpr:
+			return this->Evaluate(cast<ConditionalExprAST>(expr), frame, result);
+		case ASTForExpr:
+			return this->Evaluate(cast<ForExprAST>(expr), frame, result);
+		case ASTVar: {
+			const VarExprAST *var = cast<VarExprAST>(expr);
+			if (isa<ArrayExprAST>(var->GetInitialValue())
+					|| !this->Evaluate(var->GetInitialValue(), frame, result))
+				return false;
+
+			frame[var->GetName().str()] = result;
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+bool Evaluator::Evaluate(const BinaryExprAST *expr, Frame &frame, double &result) {
+	if (expr->GetOp() == '=') {
+		const VariableExprAST *target = dyn_cast<VariableExprAST>(expr->GetLHS());
+		if ( !target || !this->Evaluate(expr->GetRHS(), frame, result))
+			return false;
+
+		Frame::iterator it = frame.find(target->GetName().str());
+		if (it == frame.end())
+			return false;
+
+		it->second = result;
+		return true;
+	}
+
+	double operands[2];
+	if ( !this->Evaluate(expr->GetLHS(), frame, operands[0]) || !this->Evaluate(expr->GetRHS(), frame, operands[1]))
+		return false;
+
+	if (FoldBinary(expr->GetOp(), operands[0], operands[1], result))
+		return true;
+
+	map<string, Definition>::iterator it = Definitions.find(string("binary") + expr->GetOp());
+	if (it == Definitions.end() || it->second.Args.size() != 2)
+		return false;
+
+	Callee callee = { &it->second, 0, false };
+	return this->Call(callee, operands, result);
+}
+
+bool Evaluator::Evaluate(const CallExprAST *expr, Frame &frame, double &result) {
+	ArrayRef<ExprAST*> args = expr->GetArgs();
+	Callee callee;
+	if ( !this->Resolve(expr->GetCallee(), args.size(), callee))
+		return false;
+
+	SmallVector<double, 4> vals(args.size());
+	for (unsigned i = 0; i < args.size(); ++i)
+		if ( !this->Evaluate(args[i], frame, vals[i]))
+			return false;
+
+	return this->Call(callee, vals, result);
+}
+
+bool Evaluator::Evaluate(const ConditionalExprAST *expr, Frame &frame, double &result) {
+	ArrayRef<ConditionalElement> conds = expr->GetConds();
+	for (unsigned i = 0; i < conds.size(); ++i) {
+		double cond;
+		if ( !this->Evaluate(conds[i].GetCond(), frame, cond))
+			return false;
+		if (IsTrue(cond))
+			return this->Evaluate(conds[i].GetConsequence(), frame, result);
+	}
+
+	return this->Evaluate(expr->GetElse(), frame, result);
+}
+
+// the body runs before the condition is checked, as in generated loops
+bool Evaluator::Evaluate(const ForExprAST *expr, Frame &frame, double &result) {
+	double init;
+	if ( !this->Evaluate(expr->GetInit(), frame, init))
+		return false;
+
+	string iter = expr->GetIterName().str();
+	Frame::iterator old = frame.find(iter);
+	bool shadows = old != frame.end();
+	double shadowed = shadows ? old->second : 0;
+	frame[iter] = init;
+
+	double step = 1, cond;
+	do {
+		if ( !this->Evaluate(expr->GetBody(), frame, result))
+			return false;
+		if (expr->GetStep() && !this->Evaluate(expr->GetStep(), frame, step))
+			return false;
+		if ( !this->Evaluate(expr->GetEnd(), frame, cond))
+			return false;
+
+		frame[iter] += step;
+	} while (IsTrue(cond));
+
+	if (shadows)
+		frame[iter] = shadowed;
+	else
+		frame.erase(iter);
+	return true;
+}
+
+bool Evaluator::Call(const Callee &callee, ArrayRef<double> args, double &result) {
+	if (callee.Def) {
+		if (Depth >= MaxDepth)
+			return false;
+
+		Frame frame;
+		for (unsigned i = 0; i < args.size(); ++i)
+			frame[callee.Def->Args[i].str()] = args[i];
+
+		++Depth;
+		bool evaluated = this->Evaluate(callee.Def->Body, frame, result);
+		--Depth;
+		return evaluated;
+	}
+
+	// output waits until every expression has run, it returns 0
+	if (callee.Print || callee.Func->Output) {
+		Effect effect = { callee.Func, Values.size(), args.size() };
+		Effects.push_back(effect);
+		Values.insert(Values.end(), args.begin(), args.end());
+		result = 0;
+		return true;
+	}
+
+	result = callee.Func->Call(args.data());
+	return true;
+}
@@ -0,0 +1,120 @@
+#include "llvm/Module.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "AST.hpp"
+#include "ASTArena.hpp"
+
+#ifndef EVALUATOR_HPP
+#define EVALUATOR_HPP
+
+using namespace std;
+using namespace llvm;
+
+// lhs op rhs for the operators the language defines itself, false for the
+// ones programs define
+bool FoldBinary(char op, double lhs, double rhs, double &result);
+
+struct KnownFunction;
+
+// Runs top level expressions on their AST when all they do is compute with
+// constants, call functions doing the same and print, so the JIT does not
+// have to compile code that runs once. Functions and operators small enough
+// for it to keep a copy of their AST can be called, as well as the math
+// builtins and the runtime's tan, pchar, pdoub, pline, clrscr and pflush
+// through an extern. What is printed is held back until every expression
+// has run, anything else, arrays, vecs and pfor loops, and running out of
+// steps leave the expressions to the JIT as if they had never been
+// evaluated.
+class Evaluator {
+	enum {
+		// nodes evaluated for one batch of expressions before it is left to
+		// the JIT, kept small since the steps of a batch running out of
+		// them are wasted. pdoub(fib(10)) takes about 1600.
+		StepBudget = 2000,
+		// nested calls, deeper recursion is left to compiled code
+		MaxDepth = 256,
+		// nodes of the largest definition kept for calls, and of all of
+		// them together, past which calls go to compiled code. Batches
+		// small enough to evaluate rarely call anything bigger.
+		MaxDefinitionNodes = 256,
+		MaxKeptNodes = 1 << 16
+	};
+
+	struct Definition {
+		ArrayRef<StringRef> Args;
+		const BlockAST *Body;
+	};
+
+	// an output call to make once the expressions have all run, with Count
+	// arguments from Values[First]. print has no Func.
+	struct Effect {
+		const KnownFunction *Func;
+		size_t First;
+		size_t Count;
+	};
+
+	// what a call in an expression goes to
+	struct Callee {
+		const Definition *Def;
+		const KnownFunction *Func;
+		bool Print;
+	};
+
+	Module *TheModule;
+	map<string, Definition> Definitions;
+	// copies of the AST of definitions, and how many nodes were copied
+	ASTArena Kept;
+	unsigned KeptNodes;
+
+	// state of the expressions being run
+	typedef map<string, double> Frame;
+	unsigned Steps;
+	unsigned Depth;
+	vector<Effect> Effects;
+	vector<double> Values;
+
+	Evaluator(const Evaluator&);
+	Evaluator &operator=(const Evaluator&);
+
+public:
+	// calls resolve to the functions of module
+	Evaluator(Module *module);
+
+	// keep a copy of the AST of a compiled function, or of the operator
+	// function named name, for calls to it. Returns whether the function
+	// can be run, which it cannot if it is too large or does what the
+	// evaluator never runs.
+	bool Define(StringRef name, ArrayRef<StringRef> args, const BlockAST *body);
+
+	// run exprs and what they print in order, false without running
+	// anything if they have to be compiled
+	bool Run(ArrayRef<FunctionAST*> exprs);
+	// nodes the last Run evaluated, more than StepBudget if it ran out
+	unsigned GetSteps() {
+		return this->Steps;
+	}
+
+private:
+	bool Resolve(StringRef name, unsigned arity, Callee &callee);
+
+	// whether expr only uses what the evaluator can run, with names the
+	// variables in scope, as codegen would declare them
+	bool Check(const ExprAST *expr, set<string> &names);
+	bool Check(const BlockAST *block, set<string> &names);
+
+	bool Evaluate(const ExprAST *expr, Frame &frame, double &result);
+	bool Evaluate(const BlockAST *block, Frame &frame, double &result);
+	bool Evaluate(const BinaryExprAST *expr, Frame &frame, double &result);
+	bool Evaluate(const CallExprAST *expr, Frame &frame, double &result);
+	bool Evaluate(const ConditionalExprAST *expr, Frame &frame, double &result);
+	bool Evaluate(const ForExprAST *expr, Frame &frame, double &result);
+	bool Call(const Callee &callee, ArrayRef<double> args, double &result);
+};
+
+#endif
@@ -0,0 +1,93 @@
+#include "ExpressionCache.hpp"
+#include "Lexer.hpp"
+
+#include <cstdio>
+
+ExpressionCache::ExpressionCache(CompilerSession &session, ExecutionEngine *execEngine, Module *module,
+		unsigned capacity)
+		: Session(session), ExecEngine(execEngine), TheModule(module), Capacity(capacity > 0 ? capacity : 1),
+		  Created(0) {
+}
+
+// what name is defined as, defining it later makes a new key
+void ExpressionCache::AddDefinition(string &key, StringRef name) {
+	if (Function *func = TheModule->getFunction(name))
+		key += str(boost::format("@%1%") % (const void*) func);
+}
+
+string ExpressionCache::GetKey(ArrayRef<StringRef> params, StringRef expr) {
+	string key;
+	for (unsigned i = 0; i < params.size(); ++i)
+		key += params[i].str() + ' ';
+	key += ':';
+
+	Lexer lexer(Session.GetDiagnostics());
+	lexer.SetInputString("", expr);
+	map<char, int> &precedence = Session.GetPrecedence();
+
+	for (int tok = lexer.GetToken(); tok != tok_eof; tok = lexer.GetToken()) {
+		key += ' ';
+		switch (tok) {
+			case tok_identifier:
+				key += lexer.GetIdentifierStr();
+				this->AddDefinition(key, lexer.GetIdentifierStr());
+				break;
+			case tok_number: {
+				// 1, 1.0 and 1.00 are the same number
+				char number[64];
+				snprintf(number, sizeof(number), "%a", lexer.GetNumVal());
+				key += number;
+				break;
+			}
+			case tok_string:
+				key += '\'' + lexer.GetStringVal().str() + '\'';
+				break;
+			default:
+				if (tok < 0) {
+					key += str(boost::format("#%1%") % -tok);
+					break;
+				}
+
+				key += (char) tok;
+				if (precedence.count(tok))
+					key += str(boost::format("/%1%") % precedence[tok]);
+				this->AddDefinition(key, string("binary") + (char) tok);
+				this->AddDefinition(key, string("unary") + (char) tok);
+				break;
+		}
+	}
+
+	return key;
+}
+
+void *ExpressionCache::Lookup(const string &key) {
+	map<string, Entry>::iterator it = Entries.find(key);
+	if (it == Entries.end())
+		return 0;
+
+	Recent.splice(Recent.begin(), Recent, it->second.Use);
+	return it->second.Code;
+}
+
+string ExpressionCache::GetNewName() {
+	return str(boost::format("expr.%1%") % Created++);
+}
+
+void ExpressionCache::Insert(const string &key, Function *func, void *code) {
+	Recent.push_front(key);
+	Entry entry = { func, code, Recent.begin() };
+	Entries[key] = entry;
+
+	while (Entries.size() > Capacity)
+		this->Evict();
+}
+
+void ExpressionCache::Evict() {
+	map<string, Entry>::iterator it = Entries.find(Recent.back());
+	Recent.pop_back();
+
+	// nothing calls an expression's function, its code can go
+	ExecEngine->freeMachineCodeForFunction(it->second.Func);
+	it->second.Func->eraseFromParent();
+	Entries.erase(it);
+}
@@ -0,0 +1,65 @@
+#include "llvm/Module.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "CompilerSession.hpp"
+
+#ifndef EXPRESSIONCACHE_HPP
+#define EXPRESSIONCACHE_HPP
+
+using namespace std;
+using namespace llvm;
+
+// Machine code of expressions an Engine compiled on their own, so the same
+// formula submitted again is not parsed, generated and compiled again. An
+// entry is keyed by the expression's tokens, with numbers in an exact
+// canonical form and spacing and comments dropped, its parameters, and the
+// definitions its names and operators stand for when it is looked up: the
+// functions they call and the precedences of the operators. Once more than
+// the capacity of expressions are cached, the least recently used is freed.
+class ExpressionCache {
+	struct Entry {
+		Function *Func;
+		void *Code;
+		// position in Recent
+		list<string>::iterator Use;
+	};
+
+	CompilerSession &Session;
+	ExecutionEngine *ExecEngine;
+	Module *TheModule;
+	unsigned Capacity;
+	unsigned Created;
+
+	map<string, Entry> Entries;
+	// keys, most recently used first
+	list<string> Recent;
+
+public:
+	// expressions are compiled into module by execEngine, at least one is
+	// kept
+	ExpressionCache(CompilerSession &session, ExecutionEngine *execEngine, Module *module, unsigned capacity);
+
+	string GetKey(ArrayRef<StringRef> params, StringRef expr);
+	// the code cached under key, 0 if there is none
+	void *Lookup(const string &key);
+	// a name no other expression's function has
+	string GetNewName();
+	// cache func, compiled to code, under key, evicting what no longer fits
+	void Insert(const string &key, Function *func, void *code);
+
+	unsigned GetSize() {
+		return this->Entries.size();
+	}
+
+private:
+	void AddDefinition(string &key, StringRef name);
+	void Evict();
+};
+
+#endif
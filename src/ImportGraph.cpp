@@ -0,0 +1,344 @@
+#include "ImportGraph.hpp"
+#include "Driver.hpp"
+
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/system_error.h"
+
+ImportGraph::ImportGraph(CompilerSession &session, string mainFile, unsigned jobs, string dataLayout,
+		string triple, unsigned optLevel, ModuleCache *cache)
+		: Session(session), DataLayoutString(dataLayout), Triple(triple), OptLevel(optLevel), Cache(cache),
+		  Remaining(0) {
+	// report cycles at the import statement, then give locations back to
+	// whoever had them
+	Diagnostics &diag = Session.GetDiagnostics();
+	Lexer *lexer = diag.GetLexer();
+	OwningPtr<MemoryBuffer> source;
+	if ( !MemoryBuffer::getFile(mainFile, source))
+		this->Scan(mainFile, 0, true);
+	diag.SetLexer(lexer);
+
+	this->Schedule();
+	if (Remaining == 0)
+		return;
+
+	for (unsigned i = 0; i < jobs && i < Files.size(); ++i)
+		Workers.push_back(thread( &ImportGraph::Work, this));
+}
+
+ImportGraph::~ImportGraph() {
+	for (unsigned i = 0; i < Workers.size(); ++i)
+		Workers[i].join();
+
+	for (map<string, File*>::iterator it = Files.begin(); it != Files.end(); ++it)
+		delete it->second;
+}
+
+bool ImportGraph::Contains(string file) {
+	return Files.count(file) > 0;
+}
+
+string ImportGraph::GetKey(string file) {
+	map<string, File*>::iterator it = Files.find(file);
+	return it == Files.end() ? "" : it->second->Key;
+}
+
+// find the imports of path, file is 0 for the main program. prelude is set
+// while the files being read have only imported others.
+void ImportGraph::Scan(string path, File *file, bool prelude) {
+	Scanning.insert(path);
+
+	// the lexer is enough, import statements do not depend on operators
+	Diagnostics &diag = Session.GetDiagnostics();
+	Lexer lexer(diag);
+	diag.SetLexer( &lexer);
+	lexer.SetInputFile(path, 0);
+
+	for (int tok = lexer.GetToken(); tok != tok_eof; tok = lexer.GetToken()) {
+		if (tok != tok_import || (tok = lexer.GetToken()) != tok_string) {
+			if (tok != ';')
+				prelude = false;
+			continue;
+		}
+
+		string imported = lexer.GetStringVal().str() + ".wtf";
+		if (Scanning.count(imported)) {
+			diag.Throw<int>(str(boost::format("Import cycle through '%1%'") % imported));
+			continue;
+		}
+
+		File *import = this->Visit(imported, prelude);
+		diag.SetLexer( &lexer);
+		if ( !import || !file)
+			continue;
+
+		file->Imports.push_back(import);
+	}
+
+	Scanning.erase(path);
+}
+
+// the node of an imported file, scanning it the first time. 0 if it cannot
+// be read, importing it reports that.
+ImportGraph::File *ImportGraph::Visit(string path, bool prelude) {
+	map<string, File*>::iterator it = Files.find(path);
+	if (it != Files.end())
+		return it->second;
+
+	OwningPtr<MemoryBuffer> source;
+	if (MemoryBuffer::getFile(path, source))
+		return 0;
+
+	File *file = new File();
+	file->Path = path;
+	file->Done = false;
+	file->Linked = false;
+	file->Prelude = prelude;
+	file->LoadedBefore = Order.size();
+	Files[path] = file;
+
+	this->Scan(path, file, prelude);
+
+	Order.push_back(file);
+	return file;
+}
+
+// the files file imports, directly or not, each once and after its own
+// imports
+static void CollectImports(ImportGraph::File *file, vector<ImportGraph::File*> &order,
+		set<ImportGraph::File*> &seen) {
+	for (unsigned i = 0; i < file->Imports.size(); ++i) {
+		ImportGraph::File *import = file->Imports[i];
+		if ( !seen.insert(import).second)
+			continue;
+
+		CollectImports(import, order, seen);
+		order.push_back(import);
+	}
+}
+
+// decide which files are compiled ahead and queue those with no imports,
+// the driver compiles the others
+void ImportGraph::Schedule() {
+	// imports are read completely before their importers
+	for (unsigned i = 0; i < Order.size(); ++i) {
+		File *file = Order[i];
+		vector<File*> imports;
+		set<File*> seen;
+		CollectImports(file, imports, seen);
+
+		file->Ahead = file->Prelude;
+		for (unsigned j = 0; j < file->LoadedBefore && file->Ahead; ++j)
+			file->Ahead = seen.count(Order[j]) > 0;
+		for (unsigned j = 0; j < file->Imports.size() && file->Ahead; ++j)
+			file->Ahead = file->Imports[j]->Ahead;
+	}
+
+	for (unsigned i = 0; i < Order.size(); ++i) {
+		File *file = Order[i];
+		if ( !file->Ahead)
+			continue;
+
+		++Remaining;
+		file->Pending = file->Imports.size();
+		for (unsigned j = 0; j < file->Imports.size(); ++j)
+			file->Imports[j]->Dependents.push_back(file);
+		if (file->Pending == 0)
+			Ready.push_back(file);
+	}
+
+	for (unsigned i = 0; i < Order.size(); ++i)
+		if ( !Order[i]->Ahead) {
+			Files.erase(Order[i]->Path);
+			delete Order[i];
+		}
+	Order.clear();
+}
+
+void ImportGraph::Work() {
+	unique_lock<mutex> lock(Lock);
+	for (;;) {
+		while (Ready.empty() && Remaining > 0)
+			Changed.wait(lock);
+		if (Ready.empty())
+			return;
+
+		File *file = Ready.front();
+		Ready.pop_front();
+
+		lock.unlock();
+		this->Compile(file);
+		lock.lock();
+
+		file->Done = true;
+		--Remaining;
+		for (unsigned i = 0; i < file->Dependents.size(); ++i)
+			if (--file->Dependents[i]->Pending == 0)
+				Ready.push_back(file->Dependents[i]);
+		Changed.notify_all();
+	}
+}
+
+static void Declare(Module *module, StringRef name, StringRef params) {
+	LLVMContext &context = module->getContext();
+	if (module->getFunction(name))
+		return;
+
+	vector<Type*> types;
+	for (unsigned i = 0; i < params.size(); ++i) {
+		if (params[i] == 'p')
+			types.push_back(Type::getDoublePtrTy(context));
+		else if (params[i] == 'i')
+			types.push_back(Type::getInt64Ty(context));
+		else
+			types.push_back(Type::getDoubleTy(context));
+	}
+
+	FunctionType *type = FunctionType::get(Type::getDoubleTy(context), types, false);
+	Function::Create(type, Function::ExternalLinkage, name, module);
+}
+
+// runs on a worker thread, in a session of its own
+void ImportGraph::Compile(File *file) {
+	CompilerSession session(Session.GetDiagnostics().GetOutput());
+	LLVMContext &context = session.GetContext();
+	Module *module = new Module(file->Path, context);
+	module->setDataLayout(DataLayoutString);
+	module->setTargetTriple(Triple);
+
+	vector<File*> imports;
+	set<File*> seen;
+	CollectImports(file, imports, seen);
+
+	// the operators and functions of the imports, as if read before
+	map<char, int> &precedence = session.GetPrecedence();
+	for (unsigned i = 0; i < imports.size(); ++i) {
+		ModuleCache::Entry &record = imports[i]->Record;
+		for (unsigned j = 0; j < record.Operators.size(); ++j)
+			precedence[record.Operators[j].first] = record.Operators[j].second;
+
+		vector<pair<string, string> > &functions = imports[i]->Interface;
+		for (unsigned j = 0; j < functions.size(); ++j)
+			Declare(module, functions[j].first, functions[j].second);
+	}
+
+	DataLayout layout(DataLayoutString);
+	Codegen *gen = new Codegen(session, &layout, module, OptLevel);
+	// its parser adds the builtin precedences, keys see them as Driver::Load does
+	Driver *driver = new Driver(session, gen, 0, this, true);
+
+	string cacheContext;
+	if (Cache) {
+		cacheContext = ModuleCache::GetContext(precedence, gen->DescribeInlineOperators());
+		file->Key = Cache->GetKey(file->Path, cacheContext);
+	}
+
+	// a valid cache entry saves compiling
+	if ( !file->Key.empty() && Cache->LoadEntry(file->Key, file->Record) && Cache->IsValid(file->Record))
+		if (Module *cached = Cache->LoadModule(file->Key, context)) {
+			this->Finish(file, cached);
+			delete cached;
+			delete driver;
+			delete gen;
+			delete module;
+			return;
+		}
+	file->Record = ModuleCache::Entry();
+
+	driver->Go(file->Path);
+	file->Record = driver->GetRecord();
+	file->Record.Context = cacheContext;
+
+	if (Function *init = gen->GenerateInit("init." + file->Path))
+		file->Init = init->getName().str();
+	gen->RunModulePasses();
+
+	if ( !file->Key.empty() && driver->IsCacheable() && session.GetDiagnostics().GetCount() == 0) {
+		Module *definitions = gen->CloneDefinitions(driver->GetDefinitions());
+		Cache->Store(file->Key, file->Record, definitions);
+		delete definitions;
+	}
+
+	this->Finish(file, module);
+	Session.GetDiagnostics().AddCount(session.GetDiagnostics().GetCount());
+
+	// everything lives in the session's context, which goes last
+	delete driver;
+	delete gen;
+	delete module;
+}
+
+// what importers need to know of a compiled module
+void ImportGraph::Finish(File *file, Module *module) {
+	for (Module::iterator it = module->begin(); it != module->end(); ++it) {
+		if (it->hasLocalLinkage() || it->isIntrinsic() || it->getName() == file->Init)
+			continue;
+
+		FunctionType *type = it->getFunctionType();
+		if ( !type->getReturnType()->isDoubleTy() || type->isVarArg())
+			continue;
+
+		// runtime functions with other types are declared where used
+		string params;
+		for (unsigned i = 0; i < type->getNumParams(); ++i) {
+			Type *param = type->getParamType(i);
+			if (param->isDoubleTy())
+				params += 'd';
+			else if (param == Type::getDoublePtrTy(module->getContext()))
+				params += 'p';
+			else if (param->isIntegerTy(64))
+				params += 'i';
+			else
+				break;
+		}
+
+		if (params.size() == type->getNumParams())
+			file->Interface.push_back(make_pair(it->getName().str(), params));
+	}
+
+	raw_string_ostream out(file->Bitcode);
+	WriteBitcodeToFile(module, out);
+	out.flush();
+}
+
+bool ImportGraph::Link(string path, Codegen *gen, Parser &parser, vector<string> &inits) {
+	map<string, File*>::iterator it = Files.find(path);
+	if (it == Files.end())
+		return false;
+
+	File *file = it->second;
+	if (file->Linked)
+		return true;
+	file->Linked = true;
+
+	for (unsigned i = 0; i < file->Imports.size(); ++i)
+		this->Link(file->Imports[i]->Path, gen, parser, inits);
+
+	{
+		unique_lock<mutex> lock(Lock);
+		while ( !file->Done)
+			Changed.wait(lock);
+	}
+
+	MemoryBuffer *bitcode = MemoryBuffer::getMemBuffer(file->Bitcode, file->Path, false);
+	string errStr;
+	Module *module = ParseBitcodeFile(bitcode, gen->GetModule()->getContext(), &errStr);
+	delete bitcode;
+	if ( !module)
+		return Session.GetDiagnostics().Throw<bool>(str(boost::format("Could not read compiled '%1%': %2%") % path % errStr));
+
+	// the bitcode is not needed anymore
+	string().swap(file->Bitcode);
+
+	if ( !gen->LinkModule(module))
+		return false;
+
+	for (unsigned i = 0; i < file->Record.Operators.size(); ++i)
+		parser.SetPrecedence(file->Record.Operators[i].first, file->Record.Operators[i].second);
+
+	if ( !file->Init.empty())
+		inits.push_back(file->Init);
+	return true;
+}
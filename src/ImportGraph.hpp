@@ -0,0 +1,114 @@
+#include "llvm/LLVMContext.h"
+#include "llvm/Module.h"
+#include "llvm/DataLayout.h"
+
+#include "Parser.hpp"
+#include "Codegen.hpp"
+#include "ModuleCache.hpp"
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifndef IMPORTGRAPH_HPP
+#define IMPORTGRAPH_HPP
+
+using namespace std;
+using namespace llvm;
+
+// With -j, every file a program imports, directly or through other imports,
+// is found before the program is read and compiled on a pool of threads.
+// Each file gets a context and module of its own once the files it imports
+// are done, seeing their operators and declarations of their functions. The
+// results are kept as bitcode, which the program links in when it reaches
+// the import statements. Every file is compiled in a CompilerSession of its
+// own, whose errors count towards the program's session.
+//
+// Only files that would see nothing but their own imports without -j are
+// compiled ahead: those first imported before the importing files define
+// anything, after no other files than ones they import themselves, and
+// whose imports are compiled ahead too. The rest are left to the driver,
+// which compiles them when their import statement is reached, so both
+// what a file sees and the order of top level expressions stay as they
+// are without -j.
+class ImportGraph {
+public:
+	struct File {
+		string Path;
+		// cache key, empty without a cache
+		string Key;
+		vector<File*> Imports;
+		vector<File*> Dependents;
+		// imports not compiled yet
+		unsigned Pending;
+		bool Done;
+		bool Linked;
+
+		// first imported where the files being read had only imported
+		// others so far
+		bool Prelude;
+		// how many files were read completely before that
+		unsigned LoadedBefore;
+		// compiled ahead, see above
+		bool Ahead;
+
+		// what compiling produced, in forms that can cross contexts
+		string Bitcode;
+		ModuleCache::Entry Record;
+		// name and parameters ('d' double, 'p' array data, 'i' array
+		// length) of the functions it defines or declares
+		vector<pair<string, string> > Interface;
+		// runs its top level expressions, empty if there are none
+		string Init;
+	};
+
+	// start compiling the imports of mainFile on jobs threads
+	ImportGraph(CompilerSession &session, string mainFile, unsigned jobs, string dataLayout, string triple,
+			unsigned optLevel, ModuleCache *cache);
+	// waits for the threads
+	~ImportGraph();
+
+	// whether file is compiled ahead by the graph
+	bool Contains(string file);
+	string GetKey(string file);
+
+	// link file and what it imports, unless linked before, into gen's module,
+	// installing their operators in parser. The init functions of the linked
+	// files are added to inits in the order they run.
+	bool Link(string file, Codegen *gen, Parser &parser, vector<string> &inits);
+
+private:
+	CompilerSession &Session;
+	map<string, File*> Files;
+	// files being scanned, an import of one of them is a cycle
+	set<string> Scanning;
+	// files in the order they are read completely without -j, only while
+	// scanning
+	vector<File*> Order;
+
+	string DataLayoutString;
+	string Triple;
+	unsigned OptLevel;
+	ModuleCache *Cache;
+
+	mutex Lock;
+	condition_variable Changed;
+	deque<File*> Ready;
+	unsigned Remaining;
+	vector<thread> Workers;
+
+	void Scan(string path, File *file, bool prelude);
+	File *Visit(string path, bool prelude);
+	void Schedule();
+
+	void Work();
+	void Compile(File *file);
+	void Finish(File *file, Module *module);
+};
+
+#endif
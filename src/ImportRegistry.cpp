@@ -0,0 +1,31 @@
+#include "ImportRegistry.hpp"
+
+#include <cstdlib>
+
+ImportRegistry::~ImportRegistry() {
+	for (unordered_map<string, File*>::iterator it = ByPath.begin(); it != ByPath.end(); ++it)
+		delete it->second;
+}
+
+ImportRegistry::File *ImportRegistry::Find(const string &name) {
+	unordered_map<string, File*>::iterator it = ByName.find(name);
+	if (it != ByName.end())
+		return it->second;
+
+	// files that cannot be resolved keep their name, loading them reports it
+	string path = name;
+	if (char *resolved = realpath(name.c_str(), 0)) {
+		path = resolved;
+		free(resolved);
+	}
+
+	File *&file = ByPath[path];
+	if ( !file) {
+		file = new File();
+		file->Path = path;
+		file->State = Unloaded;
+	}
+
+	ByName[name] = file;
+	return file;
+}
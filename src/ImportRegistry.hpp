@@ -0,0 +1,45 @@
+#include <string>
+#include <unordered_map>
+
+#ifndef IMPORTREGISTRY_HPP
+#define IMPORTREGISTRY_HPP
+
+using namespace std;
+
+// The files a session has imported, so each is loaded once however many
+// import statements name it. Names are looked up as written first, then by
+// the canonical path of the file, so a file imported under two names is
+// still the same file.
+class ImportRegistry {
+public:
+	enum Status {
+		Unloaded,
+		// its import statements are being handled, importing it again is a
+		// cycle
+		Loading,
+		Loaded
+	};
+
+	struct File {
+		string Path;
+		Status State;
+		// cache key it was loaded under, empty without a cache
+		string Key;
+	};
+
+	ImportRegistry() {
+	}
+	~ImportRegistry();
+
+	// the file name refers to, unloaded the first time
+	File *Find(const string &name);
+
+private:
+	unordered_map<string, File*> ByName;
+	unordered_map<string, File*> ByPath;
+
+	ImportRegistry(const ImportRegistry&);
+	ImportRegistry &operator=(const ImportRegistry&);
+};
+
+#endif
@@ -1,5 +1,8 @@
 #include "Lexer.hpp"
 
+#include <algorithm>
+#include <cstring>
+
 #ifndef LEXER_H
 #define LEXER_H
 
@@ -7,25 +10,146 @@ using namespace std;
 
 void Lexer::SetInputFile(string file, int initialSeek) {
 	File = file;
-	InputFileStream.open(file);
+	CurPtr = BufferEnd = 0;
+	Stream = 0;
+	LinesBefore = 0;
+
+	// large files are mmapped, small ones are read into a heap buffer
+	if (llvm::error_code ec = MemoryBuffer::getFile(file, Buffer)) {
+		Diag.Throw<int>(str(boost::format("File not found: '%1%'") % file));
+		return;
+	}
+
+	CurPtr = Buffer->getBufferStart();
+	BufferEnd = Buffer->getBufferEnd();
+
+	if (initialSeek > BufferEnd - CurPtr)
+		initialSeek = BufferEnd - CurPtr;
+	CurPtr += initialSeek;
+}
+
+void Lexer::SetInputString(string name, StringRef source) {
+	File = name;
+	LastChar = ' ';
+	Stream = 0;
+	LinesBefore = 0;
+
+	// copied, tokens refer to the buffer after the caller's source is gone
+	Buffer.reset(MemoryBuffer::getMemBufferCopy(source, name));
+	CurPtr = Buffer->getBufferStart();
+	BufferEnd = Buffer->getBufferEnd();
+}
 
-	if ( !InputFileStream)
-	BaseError::Throw<int>(str(boost::format("File not found: '%1%'") % file));
+void Lexer::SetInputStream(string name, FILE *stream) {
+	File = name;
+	LastChar = ' ';
+	Stream = stream;
+	LinesBefore = 0;
+	TokenStart = 0;
 
-	CursorPosition = initialSeek;
-	InputFileStream.seekg(CursorPosition);
+	// nothing is read before the first token is asked for
+	Buffer.reset();
+	CurPtr = BufferEnd = 0;
 }
 
-int Lexer::GetNextChar() {
-	CursorPosition++;
-	CursorColumnPosition++;
+// the next line of the stream after what is left of the token being
+// scanned, false at its end
+bool Lexer::Refill() {
+	if ( !Stream)
+		return false;
+
+	string text;
+	const char *keep = BufferEnd;
+	if (Buffer) {
+		if (TokenStart)
+			keep = TokenStart;
+		text.assign(keep, BufferEnd);
+		LinesBefore += std::count(Buffer->getBufferStart(), keep, '\n');
+	}
 
-	char ch = InputFileStream.get();
-	if (ch == '\n') {
-		CursorLinePosition++;
-		CursorColumnPosition = 0;
+	size_t kept = text.size();
+	int c;
+	while ((c = getc(Stream)) != EOF) {
+		text += (char) c;
+		if (c == '\n')
+			break;
 	}
-	return ch;
+	if (text.size() == kept)
+		return false;
+
+	// null terminated like files, numbers are parsed in place
+	Buffer.reset(MemoryBuffer::getMemBufferCopy(text, File));
+	if (TokenStart)
+		TokenStart = Buffer->getBufferStart();
+	CurPtr = Buffer->getBufferStart() + kept;
+	BufferEnd = Buffer->getBufferEnd();
+	return true;
+}
+
+int Lexer::GetCursorLinePosition() {
+	if ( !Buffer)
+		return 0;
+
+	return LinesBefore + std::count(Buffer->getBufferStart(), CurPtr, '\n');
+}
+
+int Lexer::GetCursorColumnPosition() {
+	if ( !Buffer)
+		return 0;
+
+	const char *lineStart = CurPtr;
+	while (lineStart != Buffer->getBufferStart() && lineStart[-1] != '\n')
+		--lineStart;
+
+	return CurPtr - lineStart;
+}
+
+// keywords are perfectly hashed on their length and first character
+static constexpr int KeywordHash(size_t len, char first) {
+	return (int) (len << 8) | (unsigned char) first;
+}
+
+static int GetKeywordToken(const char *str, size_t len) {
+	switch (KeywordHash(len, str[0])) {
+		case KeywordHash(2, 'i'):
+			if (str[1] == 'f') return tok_if;
+			if (str[1] == 'n') return tok_in;
+			break;
+		case KeywordHash(2, 'o'):
+			if (str[1] == 'p') return tok_op;
+			break;
+		case KeywordHash(3, 'e'):
+			if (memcmp(str, "end", 3) == 0) return tok_end;
+			break;
+		case KeywordHash(3, 'f'):
+			if (memcmp(str, "for", 3) == 0) return tok_for;
+			break;
+		case KeywordHash(3, 'v'):
+			if (memcmp(str, "var", 3) == 0) return tok_var;
+			break;
+		case KeywordHash(4, 'e'):
+			if (memcmp(str, "else", 4) == 0) return tok_else;
+			break;
+		case KeywordHash(4, 'f'):
+			if (memcmp(str, "func", 4) == 0) return tok_func;
+			break;
+		case KeywordHash(4, 'p'):
+			if (memcmp(str, "pfor", 4) == 0) return tok_pfor;
+			break;
+		case KeywordHash(4, 't'):
+			if (memcmp(str, "then", 4) == 0) return tok_then;
+			break;
+		case KeywordHash(5, 'e'):
+			if (memcmp(str, "elsif", 5) == 0) return tok_elsif;
+			break;
+		case KeywordHash(6, 'e'):
+			if (memcmp(str, "extern", 6) == 0) return tok_extern;
+			break;
+		case KeywordHash(6, 'i'):
+			if (memcmp(str, "import", 6) == 0) return tok_import;
+			break;
+	}
+	return tok_identifier;
 }
 
 int Lexer::GetToken() {
@@ -34,36 +158,41 @@ int Lexer::GetToken() {
 
 	// check identifier
 	if (isalpha(LastChar)) {
-		IdentifierStr = LastChar;
+		TokenStart = CurPtr - 1;
 		while (isalnum(LastChar = this->GetNextChar()))
-			IdentifierStr += LastChar;
-
-		if (IdentifierStr == "func") return tok_func;
-		if (IdentifierStr == "extern") return tok_extern;
-		if (IdentifierStr == "if") return tok_if;
-		if (IdentifierStr == "then") return tok_then;
-		if (IdentifierStr == "else") return tok_else;
-		if (IdentifierStr == "elsif") return tok_elsif;
-		if (IdentifierStr == "for") return tok_for;
-		if (IdentifierStr == "in") return tok_in;
-		if (IdentifierStr == "op") return tok_op;
-		if (IdentifierStr == "import") return tok_import;
-		if (IdentifierStr == "end") return tok_end;
-		if (IdentifierStr == "var") return tok_var;
-
-		return tok_identifier;
+			;
+
+		IdentifierStr = StringRef(TokenStart, this->GetTokenEnd() - TokenStart);
+		TokenStart = 0;
+		return GetKeywordToken(IdentifierStr.data(), IdentifierStr.size());
 	}
 
 	// check number literal
 	if (isdigit(LastChar) || LastChar == '.') {
-		string NumStr;
-		do {
-			NumStr += LastChar;
+		TokenStart = CurPtr - 1;
+		do
 			LastChar = this->GetNextChar();
-		}
 		while (isdigit(LastChar) || LastChar == '.');
 
-		this->NumVal = strtod(NumStr.c_str(), 0);
+		// parse in place, the buffer is null terminated so strtod stops in time
+		const char *start = TokenStart;
+		const char *end = this->GetTokenEnd();
+		TokenStart = 0;
+		char *parsedEnd;
+		this->NumVal = strtod(start, &parsedEnd);
+
+		// strtod also reads exponents and hex, which are not part of the literal
+		if (parsedEnd > end) {
+			char literal[64];
+			size_t len = end - start;
+			if (len < sizeof(literal)) {
+				memcpy(literal, start, len);
+				literal[len] = '\0';
+				this->NumVal = strtod(literal, 0);
+			}
+			else
+				this->NumVal = strtod(string(start, len).c_str(), 0);
+		}
 		return tok_number;
 	}
 
@@ -79,17 +208,20 @@ int Lexer::GetToken() {
 
 	// parse string
 	if (LastChar == '\'') {
-		// eat '{'
-		LastChar = this->GetNextChar();
-
-		while (LastChar != '\'') {
-			StringVal += LastChar;
+		// the opening quote has already been consumed
+		TokenStart = CurPtr;
+		do
 			LastChar = this->GetNextChar();
-		}
+		while (LastChar != '\'' && LastChar != EOF);
+
+		size_t length = this->GetTokenEnd() - TokenStart;
 
-		// eat '}'
+		// eat closing quote
 		LastChar = this->GetNextChar();
 
+		StringVal = StringRef(TokenStart, length);
+		TokenStart = 0;
+
 		return tok_string;
 	}
 
@@ -1,11 +1,15 @@
 #include <cstdio>
 #include <cstdlib>
 #include <string>
-#include <fstream>
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/system_error.h"
 #include "boost/format.hpp"
 #include "Errors.hpp"
 
 using namespace std;
+using namespace llvm;
 
 #ifndef LEXER_HPP
 #define LEXER_HPP
@@ -33,28 +37,49 @@ enum Token {
 	tok_in = -32768,
 
 	tok_var = -65536,
+	tok_pfor = -131072,
 };
 
+class Diagnostics;
+
 class Lexer {
+	Diagnostics &Diag;
 	int LastChar;
 	string File;
-	ifstream InputFileStream;
-	string IdentifierStr;
-	string StringVal;
+	// identifiers and strings are views into Buffer, valid as long as the input is
+	StringRef IdentifierStr;
+	StringRef StringVal;
 	double NumVal;
 
-	int CursorPosition;
-	int CursorColumnPosition;
-	int CursorLinePosition;
+	// the whole input file is mapped (or read) into one contiguous buffer
+	// which is scanned with CurPtr, line and column are only computed on demand
+	OwningPtr<MemoryBuffer> Buffer;
+	const char *CurPtr;
+	const char *BufferEnd;
+
+	// read a line at a time when the buffer runs out, 0 for files and
+	// strings. Only the token being scanned, from TokenStart, is kept from
+	// one line to the next.
+	FILE *Stream;
+	const char *TokenStart;
+	// lines of the stream no longer in the buffer
+	int LinesBefore;
 
 public:
-	Lexer() : LastChar(' '), IdentifierStr(""), CursorLinePosition(0) {}
+	Lexer(Diagnostics &diag)
+			: Diag(diag), LastChar(' '), CurPtr(0), BufferEnd(0), Stream(0), TokenStart(0), LinesBefore(0) {
+	}
 
 	void SetInputFile(string file, int initialSeek);
+	// read source from memory, name stands in for the file in locations
+	void SetInputString(string name, StringRef source);
+	// read stream as its lines arrive, never further than the token asked
+	// for needs
+	void SetInputStream(string name, FILE *stream);
 
 	int GetToken();
 
-	string GetIdentifierStr() {
+	StringRef GetIdentifierStr() {
 		return IdentifierStr;
 	}
 	double GetNumVal() {
@@ -63,21 +88,28 @@ public:
 	string GetFile() {
 		return File;
 	}
-	string GetStringVal() {
+	StringRef GetStringVal() {
 		return StringVal;
 	}
 	int GetCursorPosition() {
-		return CursorPosition;
-	}
-	int GetCursorColumnPosition() {
-		return CursorColumnPosition;
-	}
-	int GetCursorLinePosition() {
-		return CursorLinePosition;
+		return Buffer ? CurPtr - Buffer->getBufferStart() : 0;
 	}
+	int GetCursorColumnPosition();
+	int GetCursorLinePosition();
 
 private:
-	int GetNextChar();
+	bool Refill();
+
+	int GetNextChar() {
+		if (CurPtr == BufferEnd && !this->Refill())
+			return EOF;
+		return (unsigned char) *CurPtr++;
+	}
+
+	// end of the token that has just been scanned, LastChar is not part of it
+	const char *GetTokenEnd() {
+		return LastChar == EOF ? CurPtr : CurPtr - 1;
+	}
 };
 
 #endif
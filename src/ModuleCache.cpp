@@ -0,0 +1,140 @@
+#include "ModuleCache.hpp"
+
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/system_error.h"
+
+#include "boost/format.hpp"
+
+#include <cstdio>
+#include <fstream>
+
+// bump when the generated code changes in ways the build date does not catch
+static const char *CompilerVersion = "wtf-1 " __DATE__ " " __TIME__;
+
+// 64 bit FNV-1a
+static uint64_t Hash(uint64_t hash, const char *data, size_t size) {
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= (unsigned char) data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+ModuleCache::ModuleCache(string directory, string target, unsigned optLevel)
+		: Directory(directory),
+		  Salt(string(CompilerVersion) + '\0' + target + str(boost::format(" -O%1%") % optLevel)) {
+	bool existed;
+	sys::fs::create_directories(Directory, existed);
+}
+
+string ModuleCache::GetPath(string key, string extension) {
+	return Directory + "/" + key + extension;
+}
+
+// Precedences decide how a file parses and inline operators are expanded
+// into its code, so a file compiled after others installed different ones
+// gets an entry of its own.
+string ModuleCache::GetContext(const map<char, int> &precedence, const string &inlineOps) {
+	string description;
+	for (map<char, int>::const_iterator it = precedence.begin(); it != precedence.end(); ++it)
+		description += str(boost::format("%1% %2%\n") % (int) (unsigned char) it->first % it->second);
+	description += inlineOps;
+
+	uint64_t hash = Hash(14695981039346656037ULL, description.data(), description.size());
+	return str(boost::format("%016x") % hash);
+}
+
+string ModuleCache::GetKey(string file, string context) {
+	OwningPtr<MemoryBuffer> source;
+	if (MemoryBuffer::getFile(file, source))
+		return "";
+
+	uint64_t hash = Hash(14695981039346656037ULL, Salt.data(), Salt.size());
+	hash = Hash(hash, context.c_str(), context.size() + 1);
+	hash = Hash(hash, source->getBufferStart(), source->getBufferSize());
+
+	return str(boost::format("%016x") % hash);
+}
+
+bool ModuleCache::LoadEntry(string key, Entry &entry) {
+	ifstream meta(this->GetPath(key, ".meta").c_str());
+	if ( !meta)
+		return false;
+
+	string kind;
+	while (meta >> kind) {
+		if (kind == "import") {
+			string importKey, file;
+			meta >> importKey;
+			meta.ignore(1);
+			getline(meta, file);
+			entry.Imports.push_back(make_pair(file, importKey));
+		}
+		else if (kind == "op") {
+			int op, prec;
+			meta >> op >> prec;
+			entry.Operators.push_back(make_pair((char) op, prec));
+		}
+		else if (kind == "context")
+			meta >> entry.Context;
+		else
+			return false;
+	}
+
+	return true;
+}
+
+// an import is unchanged if its source still gives the key it had in the
+// context it was compiled in
+bool ModuleCache::IsValid(const Entry &entry) {
+	for (unsigned i = 0; i < entry.Imports.size(); ++i) {
+		string key = entry.Imports[i].second;
+		Entry imported;
+		if (key.empty() || !this->LoadEntry(key, imported)
+				|| this->GetKey(entry.Imports[i].first, imported.Context) != key || !this->IsValid(imported))
+			return false;
+	}
+
+	return true;
+}
+
+Module *ModuleCache::LoadModule(string key, LLVMContext &context) {
+	OwningPtr<MemoryBuffer> bitcode;
+	if (MemoryBuffer::getFile(this->GetPath(key, ".bc"), bitcode))
+		return 0;
+
+	return ParseBitcodeFile(bitcode.get(), context);
+}
+
+void ModuleCache::Store(string key, const Entry &entry, Module *module) {
+	string bcPath = this->GetPath(key, ".bc");
+	string metaPath = this->GetPath(key, ".meta");
+	string errStr;
+
+	// write to temporaries and rename, so readers never see partial files
+	{
+		raw_fd_ostream out((bcPath + ".tmp").c_str(), errStr, raw_fd_ostream::F_Binary);
+		if ( !errStr.empty())
+			return;
+		WriteBitcodeToFile(module, out);
+	}
+
+	{
+		ofstream meta((metaPath + ".tmp").c_str());
+		for (unsigned i = 0; i < entry.Imports.size(); ++i)
+			meta << "import " << entry.Imports[i].second << " " << entry.Imports[i].first << "\n";
+		for (unsigned i = 0; i < entry.Operators.size(); ++i)
+			meta << "op " << (int) entry.Operators[i].first << " " << entry.Operators[i].second << "\n";
+		meta << "context " << entry.Context << "\n";
+		if ( !meta)
+			return;
+	}
+
+	// the meta file goes last, it marks the entry as complete
+	rename((bcPath + ".tmp").c_str(), bcPath.c_str());
+	rename((metaPath + ".tmp").c_str(), metaPath.c_str());
+}
@@ -0,0 +1,53 @@
+#include "llvm/LLVMContext.h"
+#include "llvm/Module.h"
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef MODULECACHE_HPP
+#define MODULECACHE_HPP
+
+using namespace std;
+using namespace llvm;
+
+// On-disk cache of imported files. An entry is keyed by a hash of the
+// compiler version, the target, the optimization level, the operators the
+// file sees when it is imported and the source text, and holds the optimized
+// bitcode of the file's own definitions, the operator precedences it
+// installs and the keys of the files it imports itself.
+class ModuleCache {
+	string Directory;
+	string Salt;
+
+public:
+	struct Entry {
+		// imported file and its key at the time the entry was written
+		vector<pair<string, string> > Imports;
+		vector<pair<char, int> > Operators;
+		// the context the file was compiled in, part of its key
+		string Context;
+	};
+
+	ModuleCache(string directory, string target, unsigned optLevel);
+
+	// the context of a file compiled with these precedences and inline
+	// operators, as Codegen::DescribeInlineOperators writes them
+	static string GetContext(const map<char, int> &precedence, const string &inlineOps);
+	// key of the current contents of file compiled in context, empty if it
+	// cannot be read
+	string GetKey(string file, string context);
+
+	bool LoadEntry(string key, Entry &entry);
+	Module *LoadModule(string key, LLVMContext &context);
+	void Store(string key, const Entry &entry, Module *module);
+
+	// an entry is valid if all its transitive imports are unchanged
+	bool IsValid(const Entry &entry);
+
+private:
+	string GetPath(string key, string extension);
+};
+
+#endif
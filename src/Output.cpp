@@ -0,0 +1,159 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <unistd.h>
+
+#include "BuiltIns.hpp"
+#include "DoubleFormat.hpp"
+
+using namespace std;
+
+// What programs print collects in one buffer, written when it fills up, on
+// pflush(), before wait() and at exit. On a terminal, every line is also
+// written as soon as it ends. Threads of a pfor loop share the buffer, a
+// print() line is never split between them.
+class OutputBuffer {
+	enum { Size = 1 << 16 };
+	char Data[Size];
+	size_t Used;
+	bool LineBuffered;
+
+public:
+	mutex Lock;
+
+	OutputBuffer()
+			: Used(0), LineBuffered(isatty(STDOUT_FILENO)) {
+	}
+	// pfor workers may still be printing while the program exits
+	~OutputBuffer() {
+		lock_guard<mutex> lock(Lock);
+		this->Flush();
+	}
+
+	// Lock must be held for these
+	void Write(const char *data, size_t length) {
+		if (length > Size - Used)
+			this->Flush();
+
+		if (length >= Size)
+			this->WriteOut(data, length);
+		else {
+			memcpy(Data + Used, data, length);
+			Used += length;
+		}
+
+		if (LineBuffered && memchr(data, '\n', length))
+			this->Flush();
+	}
+
+	void Put(char c) {
+		if (Used == Size)
+			this->Flush();
+		Data[Used++] = c;
+
+		if (LineBuffered && c == '\n')
+			this->Flush();
+	}
+
+	void Flush() {
+		this->WriteOut(Data, Used);
+		Used = 0;
+	}
+
+private:
+	static void WriteOut(const char *data, size_t length) {
+		while (length > 0) {
+			ssize_t written = write(STDOUT_FILENO, data, length);
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0)
+				return;
+
+			data += written;
+			length -= written;
+		}
+	}
+};
+
+static OutputBuffer Output;
+
+extern "C"
+double pchar(double ascii) {
+	lock_guard<mutex> lock(Output.Lock);
+	Output.Put((char) ascii);
+	return 0;
+}
+
+extern "C"
+double pdoub(double num) {
+	char text[32];
+	int length = FormatDouble(num, text);
+
+	lock_guard<mutex> lock(Output.Lock);
+	Output.Write(text, length);
+	return 0;
+}
+
+extern "C"
+double pline() {
+	lock_guard<mutex> lock(Output.Lock);
+	Output.Put('\n');
+	return 0;
+}
+
+extern "C"
+double pflush() {
+	lock_guard<mutex> lock(Output.Lock);
+	Output.Flush();
+	return 0;
+}
+
+extern "C"
+double pchars(double *chars, int64_t length) {
+	char text[256];
+	lock_guard<mutex> lock(Output.Lock);
+	for (int64_t i = 0; i < length; i += sizeof(text)) {
+		int64_t count = length - i < (int64_t) sizeof(text) ? length - i : sizeof(text);
+		for (int64_t j = 0; j < count; ++j)
+			text[j] = (char) chars[i + j];
+		Output.Write(text, count);
+	}
+	return 0;
+}
+
+extern "C"
+double pvals(double *values, int64_t length) {
+	return wtf_print(values, length);
+}
+
+extern "C"
+double wtf_print(double *values, int64_t count) {
+	// written a line at a time unless it is very long, the lock keeps
+	// other threads out of the line
+	char text[4096];
+	size_t length = 0;
+
+	lock_guard<mutex> lock(Output.Lock);
+	for (int64_t i = 0; i < count; ++i) {
+		if (length > sizeof(text) - 34) {
+			Output.Write(text, length);
+			length = 0;
+		}
+		length += FormatDouble(values[i], text + length);
+		text[length++] = i + 1 < count ? ' ' : '\n';
+	}
+	if (count == 0)
+		text[length++] = '\n';
+
+	Output.Write(text, length);
+	return 0;
+}
+
+extern "C"
+double clrscr() {
+	static const char clear[] = "\x1b[H\x1b[2J";
+	lock_guard<mutex> lock(Output.Lock);
+	Output.Write(clear, sizeof(clear) - 1);
+	return 0;
+}
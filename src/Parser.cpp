@@ -1,4 +1,5 @@
 #include "Parser.hpp"
+#include "Evaluator.hpp"
 
 #ifndef PARSER_CPP
 #define PARSER_CPP
@@ -7,9 +8,9 @@ using namespace std;
 using namespace llvm;
 using namespace boost;
 
-map<char, int> Parser::BinopPrecedence;
-
-Parser::Parser() {
+Parser::Parser(CompilerSession &session)
+		: Diag(session.GetDiagnostics()), BinopPrecedence(session.GetPrecedence()),
+		  TheLexer(session.GetDiagnostics()), Arena(new ASTArena()) {
 	BinopPrecedence['='] = 2;
 	BinopPrecedence['<'] = 10;
 	BinopPrecedence['+'] = 20;
@@ -17,13 +18,39 @@ Parser::Parser() {
 	BinopPrecedence['*'] = 40;
 	BinopPrecedence['/'] = 40;
 
-	BaseError::SetLexer( &TheLexer);
+	Diag.SetLexer( &TheLexer);
 }
 
 void Parser::SetInputFile(string file, int initialSeek) {
 	TheLexer.SetInputFile(file, initialSeek);
 }
 
+void Parser::SetInputString(string name, StringRef source) {
+	TheLexer.SetInputString(name, source);
+}
+
+void Parser::SetInputStream(string name, FILE *stream) {
+	TheLexer.SetInputStream(name, stream);
+}
+
+void Parser::SetPrecedence(char op, int prec) {
+	BinopPrecedence[op] = prec;
+}
+
+Parser::~Parser() {
+	delete Arena;
+}
+
+void Parser::ReleaseAST() {
+	Arena->Reset();
+}
+
+ASTArena *Parser::TakeArena() {
+	ASTArena *arena = Arena;
+	Arena = new ASTArena();
+	return arena;
+}
+
 int Parser::GetNextToken() {
 	return CurTok = TheLexer.GetToken();
 }
@@ -45,7 +72,7 @@ int Parser::GetTokPrecedence() {
 
 // Expression parsing
 ExprAST *Parser::ParseNumberExpr() {
-	ExprAST *Result = new NumberExprAST(TheLexer.GetNumVal());
+	ExprAST *Result = Arena->Create<NumberExprAST>(TheLexer.GetNumVal());
 	this->GetNextToken();
 	return Result;
 }
@@ -57,21 +84,49 @@ ExprAST *Parser::ParseParenExpr() {
 		return 0;
 
 	if (CurTok != ')')
-		return BaseError::Throw<ExprAST*>("Expected ')'");
+		return Diag.Throw<ExprAST*>("Expected ')'");
 
 	this->GetNextToken(); // eat )
 
 	return V;
 }
 
+ExprAST *Parser::ParseArrayExpr() {
+	this->GetNextToken(); // eat [
+	ExprAST *size = this->ParseExpression();
+	if ( !size)
+		return 0;
+
+	if (CurTok != ']')
+		return Diag.Throw<ExprAST*>("Expected ']' after array size");
+
+	this->GetNextToken(); // eat ]
+
+	return Arena->Create<ArrayExprAST>(size);
+}
+
 ExprAST *Parser::ParseIdentifierExpr() {
-	string IdName = TheLexer.GetIdentifierStr();
+	StringRef IdName = Arena->CopyString(TheLexer.GetIdentifierStr());
 
 	// eat the identifier
 	this->GetNextToken();
 
+	if (CurTok == '[') {
+		this->GetNextToken(); // eat [
+		ExprAST *index = this->ParseExpression();
+		if ( !index)
+			return 0;
+
+		if (CurTok != ']')
+			return Diag.Throw<ExprAST*>("Expected ']' after array index");
+
+		this->GetNextToken(); // eat ]
+
+		return Arena->Create<IndexExprAST>(IdName, index);
+	}
+
 	if (CurTok != '(')
-		return new VariableExprAST(IdName);
+		return Arena->Create<VariableExprAST>(IdName);
 
 	this->GetNextToken();
 	vector<ExprAST*> args;
@@ -91,7 +146,7 @@ ExprAST *Parser::ParseIdentifierExpr() {
 				break;
 
 			if (CurTok != ',')
-				return BaseError::Throw<ExprAST*>(str(boost::format("Expected ',' in argument list, got '%1%'") % CurTok));
+				return Diag.Throw<ExprAST*>(str(boost::format("Expected ',' in argument list, got '%1%'") % CurTok));
 
 			// eat ','
 			this->GetNextToken();
@@ -100,17 +155,17 @@ ExprAST *Parser::ParseIdentifierExpr() {
 
 	this->GetNextToken(); // eat )
 
-	return new CallExprAST(IdName, args);
+	return Arena->Create<CallExprAST>(IdName, Arena->CopyArray(args));
 }
 
 ExprAST *Parser::ParseConditional() {
 	// create the list of conditionals in the if statement
-	vector<ConditionalElement*> conds;
+	vector<ConditionalElement> conds;
 
 	// parse the list of conditionals in the 'if' statement
 	while (1) {
 		if (CurTok != tok_elsif && CurTok != tok_else && CurTok != tok_if)
-			return BaseError::Throw<ExprAST*>("Expected 'else' or 'elsif'");
+			return Diag.Throw<ExprAST*>("Expected 'else' or 'elsif'");
 
 		this->GetNextToken(); // eat 'if' or 'elsif'
 
@@ -118,16 +173,16 @@ ExprAST *Parser::ParseConditional() {
 		ExprAST *cond = this->ParseExpression();
 
 		if (this->GetCurTok() != tok_then)
-			return BaseError::Throw<ExprAST*>("Expected 'then'");
+			return Diag.Throw<ExprAST*>("Expected 'then'");
 
 		this->GetNextToken(); // eat then
 
 		// parse the body
 		BlockAST *then = this->ParseBlock(tok_elsif, tok_else);
+		if ( !then)
+			return 0;
 
-		ConditionalElement *condelm = new ConditionalElement(cond, then);
-
-		conds.push_back(condelm);
+		conds.push_back(ConditionalElement(cond, then));
 
 		if (CurTok != tok_elsif)
 			break;
@@ -135,27 +190,48 @@ ExprAST *Parser::ParseConditional() {
 	// TODO default else block to null
 	// parse the 'else' block
 	if (this->GetCurTok() != tok_else)
-		return BaseError::Throw<ExprAST*>("Expected 'else'");
+		return Diag.Throw<ExprAST*>("Expected 'else'");
 
 	this->GetNextToken(); // eat else
 
 	BlockAST *els = this->ParseBlock();
+	if ( !els)
+		return 0;
 
 	if (CurTok != tok_end)
-		return BaseError::Throw<ExprAST*>("Expected 'end' after 'else'");
+		return Diag.Throw<ExprAST*>("Expected 'end' after 'else'");
 
-	return new ConditionalExprAST(conds, els);
+	return Arena->Create<ConditionalExprAST>(Arena->CopyArray(conds), els);
 }
 
 ExprAST *Parser::ParseFor() {
-	// eat 'for'
+	bool parallel = CurTok == tok_pfor;
+
+	// eat 'for' or 'pfor'
 	this->GetNextToken();
 
-	string iterName = TheLexer.GetIdentifierStr();
+	StringRef iterName = Arena->CopyString(TheLexer.GetIdentifierStr());
 
 	this->GetNextToken();
+
+	// 'pfor sum i = ...', the first name was the reduction
+	Reduction reduce = NoReduction;
+	if (parallel && CurTok == tok_identifier) {
+		if (iterName == "sum")
+			reduce = SumReduction;
+		else if (iterName == "min")
+			reduce = MinReduction;
+		else if (iterName == "max")
+			reduce = MaxReduction;
+		else
+			return Diag.Throw<ExprAST*>(str(format("Unknown pfor reduction '%1%', expected sum, min or max")
+					% iterName.str()));
+
+		iterName = Arena->CopyString(TheLexer.GetIdentifierStr());
+		this->GetNextToken();
+	}
 	if (CurTok != '=')
-		return BaseError::Throw<ExprAST*>("For loop initializer must be assignment, missing '='");
+		return Diag.Throw<ExprAST*>("For loop initializer must be assignment, missing '='");
 
 	// eat '='
 	this->GetNextToken();
@@ -165,7 +241,7 @@ ExprAST *Parser::ParseFor() {
 		return 0;
 
 	if (CurTok != ',')
-		return BaseError::Throw<ExprAST*>("Expected ',' after for loop initializer");
+		return Diag.Throw<ExprAST*>("Expected ',' after for loop initializer");
 
 	// eat ','
 	this->GetNextToken();
@@ -174,6 +250,14 @@ ExprAST *Parser::ParseFor() {
 	if (end == 0)
 		return 0;
 
+	// the iterations of a pfor are counted up front
+	if (parallel) {
+		BinaryExprAST *cond = dyn_cast<BinaryExprAST>(end);
+		VariableExprAST *iter = cond ? dyn_cast<VariableExprAST>(cond->GetLHS()) : 0;
+		if ( !iter || cond->GetOp() != '<' || iter->GetName() != iterName)
+			return Diag.Throw<ExprAST*>(str(format("pfor condition must be '%1% < <bound>'") % iterName.str()));
+	}
+
 	ExprAST *step = 0;
 	if (CurTok == ',') {
 		// eat ','
@@ -185,18 +269,20 @@ ExprAST *Parser::ParseFor() {
 	}
 
 	if (CurTok != tok_in)
-		return BaseError::Throw<ExprAST*>("Expected 'in' before loop body");
+		return Diag.Throw<ExprAST*>("Expected 'in' before loop body");
 
 	// eat 'in'
 	this->GetNextToken();
 
 	BlockAST *body = this->ParseBlock();
+	if ( !body)
+		return 0;
 
-	return new ForExprAST(iterName, init, step, end, body);
+	return Arena->Create<ForExprAST>(iterName, init, step, end, body, parallel, reduce);
 }
 
 ExprAST *Parser::ParseUnary() {
-	if ( !isascii(CurTok) || CurTok == '(' || CurTok == ',')
+	if ( !isascii(CurTok) || CurTok == '(' || CurTok == ',' || CurTok == '[')
 		return this->ParsePrimary();
 
 	// save the operator
@@ -205,7 +291,7 @@ ExprAST *Parser::ParseUnary() {
 	ExprAST *operand = this->ParseUnary();
 
 	if (operand)
-		return new UnaryExprAST(op, operand);
+		return Arena->Create<UnaryExprAST>(op, operand);
 
 	return 0;
 }
@@ -215,22 +301,22 @@ ExprAST *Parser::ParseVarExpr() {
 	this->GetNextToken();
 
 	if (CurTok != tok_identifier)
-		BaseError::Throw<int>("Expected identifier");
+		Diag.Throw<int>("Expected identifier");
 
-	string id = TheLexer.GetIdentifierStr();
+	StringRef id = Arena->CopyString(TheLexer.GetIdentifierStr());
 
 	// eat id name
 	this->GetNextToken();
 
 	if (CurTok != '=')
-		BaseError::Throw<int>("Expected assignment after identifier name");
+		Diag.Throw<int>("Expected assignment after identifier name");
 
 	// eat '='
 	this->GetNextToken();
 
 	ExprAST *initVal = this->ParseExpression();
 
-	return new VarExprAST(id, initVal);
+	return Arena->Create<VarExprAST>(id, initVal);
 }
 
 ExprAST *Parser::ParsePrimary() {
@@ -242,6 +328,7 @@ ExprAST *Parser::ParsePrimary() {
 		case tok_if:
 			return this->ParseConditional();
 		case tok_for:
+		case tok_pfor:
 			return this->ParseFor();
 		case tok_end:
 			this->GetNextToken(); // eat 'end'
@@ -249,12 +336,13 @@ ExprAST *Parser::ParsePrimary() {
 		case tok_var:
 			return this->ParseVarExpr();
 		case tok_eof:
-			BaseError::Throw<ExprAST*>("Unexpected EOF");
-			exit(0);
+			return Diag.Throw<ExprAST*>("Unexpected EOF");
 		case '(':
 			return this->ParseParenExpr();
+		case '[':
+			return this->ParseArrayExpr();
 		default:
-			return BaseError::Throw<ExprAST*>(str(format("Expected expression, token: %1%")
+			return Diag.Throw<ExprAST*>(str(format("Expected expression, token: %1%")
 					% (Token) CurTok).c_str());
 	}
 }
@@ -298,7 +386,13 @@ ExprAST *Parser::ParseBinOpRHS(int exprPrec, ExprAST* lhs) {
 				return 0;
 		}
 
-		lhs = new BinaryExprAST(binOp, lhs, rhs);
+		// arithmetic on literals is done right away
+		double folded;
+		if (isa<NumberExprAST>(lhs) && isa<NumberExprAST>(rhs)
+				&& FoldBinary(binOp, cast<NumberExprAST>(lhs)->GetVal(), cast<NumberExprAST>(rhs)->GetVal(), folded))
+			lhs = Arena->Create<NumberExprAST>(folded);
+		else
+			lhs = Arena->Create<BinaryExprAST>(binOp, lhs, rhs);
 	}
 
 	return 0;
@@ -306,23 +400,35 @@ ExprAST *Parser::ParseBinOpRHS(int exprPrec, ExprAST* lhs) {
 
 PrototypeAST *Parser::ParsePrototype() {
 	if (CurTok != tok_identifier)
-		return BaseError::Throw<PrototypeAST*>("Expected name of function");
+		return Diag.Throw<PrototypeAST*>("Expected name of function");
 
-	string name = TheLexer.GetIdentifierStr();
+	StringRef name = Arena->CopyString(TheLexer.GetIdentifierStr());
 	this->GetNextToken(); // eat name
 
 	if (CurTok != '(')
-		return BaseError::Throw<PrototypeAST*>("Expected '(' after name of function");
+		return Diag.Throw<PrototypeAST*>("Expected '(' after name of function");
 
 	// eat '('
 	this->GetNextToken();
 
-	vector<string> args;
+	vector<StringRef> args;
+	vector<ArgKind> kinds;
 	while (CurTok == tok_identifier) {
-		args.push_back(TheLexer.GetIdentifierStr());
+		args.push_back(Arena->CopyString(TheLexer.GetIdentifierStr()));
+		kinds.push_back(ScalarArg);
 
 		this->GetNextToken();
 
+		// 'name[]' takes an array
+		if (CurTok == '[') {
+			this->GetNextToken(); // eat [
+			if (CurTok != ']')
+				return Diag.Throw<PrototypeAST*>("Expected ']' after array argument");
+
+			this->GetNextToken(); // eat ]
+			kinds.back() = ArrayArg;
+		}
+
 		// eat ',' if present
 		if (CurTok == ',') {
 			this->GetNextToken();
@@ -330,11 +436,11 @@ PrototypeAST *Parser::ParsePrototype() {
 	}
 
 	if (CurTok != ')')
-		return BaseError::Throw<PrototypeAST*>("Expected ')' at end of function name");
+		return Diag.Throw<PrototypeAST*>("Expected ')' at end of function name");
 
 	this->GetNextToken(); // eat )
 
-	return new PrototypeAST(name, args);
+	return Arena->Create<PrototypeAST>(name, Arena->CopyArray(args), Arena->CopyArray(kinds));
 }
 
 FunctionAST *Parser::ParseDefinition() {
@@ -344,8 +450,10 @@ FunctionAST *Parser::ParseDefinition() {
 		return 0;
 
 	BlockAST *body = this->ParseBlock();
+	if ( !body)
+		return 0;
 
-	return new FunctionAST(prototype, body);
+	return Arena->Create<FunctionAST>(prototype, body);
 }
 
 BlockAST *Parser::ParseBlock() {
@@ -357,15 +465,20 @@ BlockAST *Parser::ParseBlock(int endOfBlock) {
 }
 
 BlockAST *Parser::ParseBlock(int endOfBlock, int endOfBlockAlt) {
-	BlockAST *block = new BlockAST(123);
+	vector<ExprAST*> exprs;
 
 	while (CurTok != endOfBlock && CurTok != endOfBlockAlt) {
-		block->AppendExpression(this->ParseExpression());
+		ExprAST *expr = this->ParseExpression();
+		exprs.push_back(expr);
+		// the input ended inside the block, reported already unless the
+		// expression was complete
+		if (CurTok == tok_eof)
+			return expr ? Diag.Throw<BlockAST*>("Unexpected EOF") : 0;
 		// eat ';' or 'and'
 		this->GetNextToken();
 	}
 
-	return block;
+	return Arena->Create<BlockAST>(Arena->CopyArray(exprs));
 }
 
 OperatorAST *Parser::ParseOperator() {
@@ -378,40 +491,42 @@ OperatorAST *Parser::ParseOperator() {
 	this->GetNextToken();
 
 	if (CurTok != tok_number)
-		return BaseError::Throw<OperatorAST*>("Expected precedence after operator");
+		return Diag.Throw<OperatorAST*>("Expected precedence after operator");
 
 	int prec = TheLexer.GetNumVal();
 	// eat precendence
 	this->GetNextToken();
 
 	if (CurTok != '(')
-		return BaseError::Throw<OperatorAST*>("Expected '(' after operator precedence");
+		return Diag.Throw<OperatorAST*>("Expected '(' after operator precedence");
 
 	// eat '('
 	this->GetNextToken();
 
-	vector<string> args;
+	vector<StringRef> args;
 	while (CurTok == tok_identifier) {
-		args.push_back(TheLexer.GetIdentifierStr());
+		args.push_back(Arena->CopyString(TheLexer.GetIdentifierStr()));
 		this->GetNextToken();
 	}
 
 	if (args.size() > 2 || args.size() < 1) {
-		return BaseError::Throw<OperatorAST*>("Wrong number of arguments for operator definition, 1 or 2 expected");
+		return Diag.Throw<OperatorAST*>("Wrong number of arguments for operator definition, 1 or 2 expected");
 	}
 
 	if (CurTok != ')')
-		return BaseError::Throw<OperatorAST*>("Expected ')' after operator arguments");
+		return Diag.Throw<OperatorAST*>("Expected ')' after operator arguments");
 
 	// eat ')'
 	this->GetNextToken();
 
 	BlockAST* body = this->ParseBlock();
+	if ( !body)
+		return 0;
 
 	// install precedence
-	BinopPrecedence[op] = prec;
+	SetPrecedence(op, prec);
 
-	return new OperatorAST(op, prec, args, body);
+	return Arena->Create<OperatorAST>(op, prec, Arena->CopyArray(args), body);
 }
 
 PrototypeAST *Parser::ParseExtern() {
@@ -422,26 +537,45 @@ PrototypeAST *Parser::ParseExtern() {
 // Top level expressions
 FunctionAST *Parser::ParseTopLevelExpr() {
 	if (ExprAST *expr = this->ParseExpression()) {
-		vector<string> args;
-		PrototypeAST *prototype = new PrototypeAST("", args);
+		PrototypeAST *prototype = Arena->Create<PrototypeAST>(StringRef(), ArrayRef<StringRef>());
 		// wrap the expression in a block
-		BlockAST *block = new BlockAST(expr);
-		return new FunctionAST(prototype, block);
+		BlockAST *block = Arena->Create<BlockAST>(Arena->CopyArray(makeArrayRef(expr)));
+		return Arena->Create<FunctionAST>(prototype, block);
 	}
 	return 0;
 }
 
+FunctionAST *Parser::ParseExpressionFunction(StringRef name, ArrayRef<StringRef> params) {
+	ExprAST *expr = this->ParseExpression();
+	if ( !expr)
+		return 0;
+
+	// eat ';' or the 'end' of an 'if' or 'for'
+	if (CurTok == ';' || CurTok == tok_end)
+		this->GetNextToken();
+	if (CurTok != tok_eof)
+		return Diag.Throw<FunctionAST*>("Expected the end of the expression");
+
+	vector<StringRef> args;
+	for (unsigned i = 0; i < params.size(); ++i)
+		args.push_back(Arena->CopyString(params[i]));
+
+	PrototypeAST *prototype = Arena->Create<PrototypeAST>(Arena->CopyString(name), Arena->CopyArray(args));
+	BlockAST *block = Arena->Create<BlockAST>(Arena->CopyArray(makeArrayRef(expr)));
+	return Arena->Create<FunctionAST>(prototype, block);
+}
+
 ImportAST *Parser::ParseImport() {
 	if (CurTok != tok_import)
-		return BaseError::Throw<ImportAST*>("Expected import statement");
+		return Diag.Throw<ImportAST*>("Expected import statement");
 
 	// eat 'import'
 	this->GetNextToken();
 
 	if (CurTok != tok_string)
-		return BaseError::Throw<ImportAST*>("Expected file name after import");
+		return Diag.Throw<ImportAST*>("Expected file name after import");
 
-	return new ImportAST(TheLexer.GetStringVal(), TheLexer.GetCursorPosition());
+	return Arena->Create<ImportAST>(Arena->CopyString(TheLexer.GetStringVal()), TheLexer.GetCursorPosition());
 }
 
 #endif
@@ -9,7 +9,9 @@
 
 #include "Lexer.hpp"
 #include "Errors.hpp"
+#include "CompilerSession.hpp"
 #include "AST.hpp"
+#include "ASTArena.hpp"
 
 #include "boost/format.hpp"
 
@@ -17,12 +19,17 @@
 #define PARSER_HPP
 
 class Parser {
-	static map<char, int> BinopPrecedence;
+	Diagnostics &Diag;
+	// the session's table, imports install their operators in it
+	map<char, int> &BinopPrecedence;
 	Lexer TheLexer;
 	int CurTok;
+	// owns the nodes of the item currently being parsed
+	ASTArena *Arena;
 
 public:
-	Parser();
+	Parser(CompilerSession &session);
+	~Parser();
 	int GetCurTok();
 	int GetNextToken();
 	Lexer *GetLexer() {
@@ -30,10 +37,21 @@ public:
 	}
 
 	void SetInputFile(string file, int initialSeek);
+	void SetInputString(string name, StringRef source);
+	void SetInputStream(string name, FILE *stream);
+
+	// install a binary operator precedence, as defining the operator would
+	void SetPrecedence(char op, int prec);
+
+	// free all AST nodes parsed since the last release
+	void ReleaseAST();
+	// hand the nodes parsed since the last release over to the caller
+	ASTArena *TakeArena();
 
 	ExprAST *ParseNumberExpr();
 	ExprAST *ParseExpression();
 	ExprAST *ParseParenExpr();
+	ExprAST *ParseArrayExpr();
 	ExprAST *ParseIdentifierExpr();
 	ExprAST *ParseUnary();
 	ExprAST *ParsePrimary();
@@ -51,6 +69,9 @@ public:
 	OperatorAST *ParseOperator();
 	PrototypeAST *ParseExtern();
 	FunctionAST *ParseTopLevelExpr();
+	// the whole input as one expression, the body of a function name of
+	// params
+	FunctionAST *ParseExpressionFunction(StringRef name, ArrayRef<StringRef> params);
 
 	ImportAST *ParseImport();
 
@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <cstdlib>
+
+#include "ThreadPool.hpp"
+#include "BuiltIns.hpp"
+
+// chunks per thread, enough to even out iterations of different cost
+static const int64_t ChunksPerThread = 8;
+// upper bound of WTF_THREADS
+static const long MaxThreadsPerCore = 4;
+
+static __thread bool RunningChunks = false;
+
+ThreadPool &ThreadPool::Get() {
+	// never destroyed, the workers are still waiting when the program exits
+	static ThreadPool *pool = 0;
+	static once_flag created;
+
+	struct Create {
+		static void Pool() {
+			long cores = thread::hardware_concurrency();
+			if (cores < 1)
+				cores = 1;
+
+			// values that are not a positive number are ignored, more
+			// threads than MaxThreadsPerCore per core only cost memory
+			long threads = cores;
+			if (const char *env = getenv("WTF_THREADS")) {
+				char *end;
+				long value = strtol(env, &end, 10);
+				if (end != env && *end == '\0' && value > 0)
+					threads = min(value, cores * MaxThreadsPerCore);
+			}
+			pool = new ThreadPool(threads);
+		}
+	};
+	call_once(created, Create::Pool);
+
+	return *pool;
+}
+
+bool ThreadPool::InPool() {
+	return RunningChunks;
+}
+
+ThreadPool::ThreadPool(unsigned threads)
+		: Generation(0), Func(0), Env(0), Results(0), Remaining(0) {
+	for (unsigned i = 0; i < threads; ++i)
+		Queues.push_back(new Queue());
+
+	for (unsigned i = 1; i < threads; ++i)
+		Workers.push_back(thread( &ThreadPool::WorkerLoop, this, i));
+}
+
+void ThreadPool::Run(ChunkFunc func, void *env, int64_t count, vector<double> &results) {
+	lock_guard<mutex> running(RunLock);
+
+	int64_t threads = Queues.size();
+	int64_t chunks = count < threads * ChunksPerThread ? count : threads * ChunksPerThread;
+	results.assign(chunks, 0.0);
+
+	Func = func;
+	Env = env;
+	Results = results.data();
+	Remaining = chunks;
+
+	// every thread gets a contiguous share of the chunks
+	for (int64_t i = 0; i < chunks; ++i) {
+		Chunk chunk;
+		chunk.Begin = count * i / chunks;
+		chunk.End = count * (i + 1) / chunks;
+		chunk.Index = i;
+
+		Queue *queue = Queues[i * threads / chunks];
+		lock_guard<mutex> queueLock(queue->Lock);
+		queue->Chunks.push_back(chunk);
+	}
+
+	{
+		lock_guard<mutex> lock(Lock);
+		++Generation;
+	}
+	Wake.notify_all();
+
+	this->Work(0);
+
+	unique_lock<mutex> lock(Lock);
+	while (Remaining != 0)
+		Done.wait(lock);
+}
+
+// the next chunk of the own share, or one stolen from the end of another's
+bool ThreadPool::Pop(unsigned self, Chunk &chunk) {
+	Queue *own = Queues[self];
+	{
+		lock_guard<mutex> lock(own->Lock);
+		if ( !own->Chunks.empty()) {
+			chunk = own->Chunks.front();
+			own->Chunks.pop_front();
+			return true;
+		}
+	}
+
+	for (unsigned i = 1; i < Queues.size(); ++i) {
+		Queue *victim = Queues[(self + i) % Queues.size()];
+		lock_guard<mutex> lock(victim->Lock);
+		if ( !victim->Chunks.empty()) {
+			chunk = victim->Chunks.back();
+			victim->Chunks.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::Work(unsigned self) {
+	bool running = RunningChunks;
+	RunningChunks = true;
+
+	Chunk chunk;
+	while (this->Pop(self, chunk)) {
+		Results[chunk.Index] = Func(Env, chunk.Begin, chunk.End);
+
+		if (--Remaining == 0) {
+			lock_guard<mutex> lock(Lock);
+			Done.notify_all();
+		}
+	}
+
+	RunningChunks = running;
+}
+
+void ThreadPool::WorkerLoop(unsigned self) {
+	unsigned seen = 0;
+	for (;;) {
+		{
+			unique_lock<mutex> lock(Lock);
+			while (Generation == seen)
+				Wake.wait(lock);
+			seen = Generation;
+		}
+		this->Work(self);
+	}
+}
+
+extern "C"
+double wtf_pfor(double (*body)(void*, int64_t, int64_t), void *env, int64_t count, int32_t reduction) {
+	ThreadPool &pool = ThreadPool::Get();
+	if (count <= 1 || pool.GetThreadCount() == 1 || ThreadPool::InPool())
+		return body(env, 0, count);
+
+	vector<double> results;
+	pool.Run(body, env, count, results);
+
+	// combined in chunk order, so sums do not depend on the scheduling
+	double result = results[0];
+	for (unsigned i = 1; i < results.size(); ++i) {
+		switch (reduction) {
+			case 1:
+				result += results[i];
+				break;
+			case 2:
+				result = results[i] < result ? results[i] : result;
+				break;
+			case 3:
+				result = results[i] > result ? results[i] : result;
+				break;
+		}
+	}
+	return result;
+}
@@ -0,0 +1,71 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using namespace std;
+
+// Runs the iterations of pfor loops on all cores. A loop's range is cut into
+// chunks, every thread starts on a contiguous share of them and threads that
+// run out steal from the far end of the others' shares. The thread starting
+// a loop works on it too and returns once all chunks are done.
+class ThreadPool {
+public:
+	// runs iterations [begin, end) and returns their combined value
+	typedef double (*ChunkFunc)(void *env, int64_t begin, int64_t end);
+
+	// the pool used by wtf_pfor, WTF_THREADS overrides the number of threads
+	static ThreadPool &Get();
+	// whether the calling thread is running chunks, nested loops run serially
+	static bool InPool();
+
+	unsigned GetThreadCount() {
+		return this->Queues.size();
+	}
+
+	// run [0, count) in chunks, the value of each chunk is stored in results
+	// in the order of the chunks
+	void Run(ChunkFunc func, void *env, int64_t count, vector<double> &results);
+
+private:
+	struct Chunk {
+		int64_t Begin, End;
+		unsigned Index;
+	};
+	struct Queue {
+		mutex Lock;
+		deque<Chunk> Chunks;
+	};
+
+	// queue 0 belongs to the thread calling Run
+	vector<Queue*> Queues;
+	vector<thread> Workers;
+
+	// one loop at a time
+	mutex RunLock;
+
+	mutex Lock;
+	condition_variable Wake;
+	condition_variable Done;
+	unsigned Generation;
+
+	// the loop being run, set before its chunks are queued
+	ChunkFunc Func;
+	void *Env;
+	double *Results;
+	atomic<int64_t> Remaining;
+
+	ThreadPool(unsigned threads);
+
+	bool Pop(unsigned self, Chunk &chunk);
+	void Work(unsigned self);
+	void WorkerLoop(unsigned self);
+};
+
+#endif
@@ -4,34 +4,195 @@
 #include <vector>
 #include <map>
 #include <iostream>
+#include <cerrno>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetRegistry.h"
 
 #include "Driver.hpp"
 #include "BuiltIns.hpp"
 
+static CompilerSession *session;
 static Driver *driver;
 
+static void Usage() {
+	fprintf(stderr, "usage: wtf [-c] [-o <output>] [-O0|-O1|-O2|-O3] [-cache <dir>] [-lazy] [-j <jobs>] <file.wtf>|-\n");
+	exit(1);
+}
+
+// '-' reads the program from stdin while it is being written
+static void Read(string inputFile) {
+	if (inputFile == "-")
+		driver->GoStream("<stdin>", stdin);
+	else
+		driver->Go(inputFile);
+}
+
+// run cc on objectFile, without a shell so any characters in the paths are
+// taken as they are. The exit status of cc, -1 if it could not be run.
+static int Link(string objectFile, string outputFile, string binDir) {
+	string libDir = "-L" + binDir;
+	const char *argv[] = {
+		"cc", objectFile.c_str(), "-o", outputFile.c_str(), libDir.c_str(),
+		"-lwtfrt", "-lstdc++", "-lm", "-lpthread", 0
+	};
+
+	pid_t pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		execvp(argv[0], (char **) argv);
+		_exit(127);
+	}
+
+	int status;
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// compile the program to an object file and, unless objectOnly is set,
+// link it against the runtime library next to the wtf binary
+static int CompileNative(Module *module, string inputFile, string outputFile, bool objectOnly,
+		string binDir, string cacheDir, unsigned optLevel, unsigned jobs) {
+	InitializeNativeTargetAsmPrinter();
+
+	string ErrStr;
+	string triple = sys::getDefaultTargetTriple();
+	const Target *target = TargetRegistry::lookupTarget(triple, ErrStr);
+	if ( !target) {
+		fprintf(stderr, "Could not find target: %s\n", ErrStr.c_str());
+		return 1;
+	}
+
+	TargetMachine *machine = target->createTargetMachine(triple, sys::getHostCPUName(), "",
+			TargetOptions(), Reloc::PIC_, CodeModel::Default, Codegen::CodeGenLevel(optLevel));
+	module->setTargetTriple(triple);
+	module->setDataLayout(machine->getDataLayout()->getStringRepresentation());
+
+	Codegen *gen = new Codegen( *session, machine->getDataLayout(), module, optLevel);
+	ModuleCache *cache = cacheDir.empty() ? 0 : new ModuleCache(cacheDir, triple, optLevel);
+	ImportGraph *graph = jobs > 1 ? new ImportGraph( *session, inputFile, jobs, module->getDataLayout(), triple, optLevel,
+			cache) : 0;
+	driver = new Driver( *session, gen, cache, graph);
+	Read(inputFile);
+	delete graph;
+	gen->GenerateMain();
+
+	if (session->GetDiagnostics().GetCount() > 0)
+		return 1;
+
+	gen->RunModulePasses(true);
+
+	string objectFile = objectOnly ? outputFile : outputFile + ".o";
+	if ( !gen->EmitObjectFile(machine, objectFile, ErrStr)) {
+		fprintf(stderr, "Could not write object file '%s': %s\n", objectFile.c_str(), ErrStr.c_str());
+		return 1;
+	}
+
+	if (objectOnly)
+		return 0;
+
+	int status = Link(objectFile, outputFile, binDir);
+	remove(objectFile.c_str());
+
+	if (status != 0) {
+		fprintf(stderr, "Linking '%s' failed\n", outputFile.c_str());
+		return 1;
+	}
+	return 0;
+}
+
 int main(int argc, const char *argv[]) {
+	bool compileOnly = false;
+	bool lazy = false;
+	unsigned optLevel = 1;
+	unsigned jobs = 1;
+	string inputFile;
+	string outputFile;
+	string cacheDir;
+
+	for (int i = 1; i < argc; ++i) {
+		string arg(argv[i]);
+		if (arg == "-c")
+			compileOnly = true;
+		else if (arg == "-o" && i + 1 < argc)
+			outputFile = argv[++i];
+		else if (arg == "-cache" && i + 1 < argc)
+			cacheDir = argv[++i];
+		else if (arg == "-lazy")
+			lazy = true;
+		else if (arg == "-j" && i + 1 < argc)
+			jobs = atoi(argv[++i]);
+		else if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' && arg[2] >= '0' && arg[2] <= '3')
+			optLevel = arg[2] - '0';
+		else if ((arg[0] == '-' && arg != "-") || !inputFile.empty())
+			Usage();
+		else
+			inputFile = arg;
+	}
+
+	if (inputFile.empty())
+		Usage();
+
 	InitializeNativeTarget();
 
-	LLVMContext &Context = getGlobalContext();
+	session = new CompilerSession();
+	LLVMContext &Context = session->GetContext();
 	Module *module = new Module("WTFJIT", Context);
 
+	if (compileOnly || !outputFile.empty()) {
+		// default to the input name with its extension, if the file name
+		// has one, replaced
+		if (outputFile.empty() && inputFile == "-")
+			outputFile = "stdin.o";
+		else if (outputFile.empty()) {
+			size_t slash = inputFile.rfind('/');
+			size_t name = slash == string::npos ? 0 : slash + 1;
+			size_t dot = inputFile.rfind('.');
+			if (dot != string::npos && dot > name)
+				outputFile = inputFile.substr(0, dot) + ".o";
+			else
+				outputFile = inputFile + ".o";
+		}
+
+		// the runtime library is next to the wtf binary, wherever it was
+		// found, argv[0] has no directory when run through PATH
+		sys::Path exe = sys::Path::GetMainExecutable(argv[0], (void*)(intptr_t) &Usage);
+		string binDir = exe.isEmpty() ? "." : exe.getDirname().str();
+
+		return CompileNative(module, inputFile, outputFile, compileOnly, binDir, cacheDir, optLevel, jobs);
+	}
+
 	string ErrStr;
-	ExecutionEngine *execEngine = EngineBuilder(module).setErrorStr( &ErrStr).create();
+	ExecutionEngine *execEngine = EngineBuilder(module).setErrorStr( &ErrStr)
+			.setOptLevel(Codegen::CodeGenLevel(optLevel)).create();
 	if ( !execEngine) {
 		fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
 		exit(1);
 	}
 
-	driver = new Driver(new Codegen(execEngine, module));
+	Codegen *gen = new Codegen( *session, execEngine, module, optLevel);
+	if (lazy)
+		gen->EnableLazyCompilation();
 
-	string inputFile(argv[1]);
+	// the module has no triple of its own, the JIT compiles for the host
+	string triple = sys::getDefaultTargetTriple();
+	ModuleCache *cache = cacheDir.empty() ? 0 : new ModuleCache(cacheDir, triple, optLevel);
+	ImportGraph *graph = jobs > 1 ? new ImportGraph( *session, inputFile, jobs,
+			execEngine->getDataLayout()->getStringRepresentation(), triple, optLevel, cache) : 0;
+	driver = new Driver( *session, gen, cache, graph);
 
-	driver->Go(inputFile);
+	Read(inputFile);
+	delete graph;
 
-	// hax to flush cout
+	// end the last line, the output buffer is written at exit
 	pline();
 
 	return 0;
 }
-